@@ -0,0 +1,244 @@
+/*
+This file is part of Simple Office Open XML Document (docx) Library.
+
+Simple Office Open XML Document (docx) Library is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of
+the License, or (at your option) any later version.
+
+Simple Office Open XML Document (docx) Library is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with Simple Office Open XML Document (docx) Library.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Document generation benchmark. Every phase of every scenario is reported as one JSON object
+// per line on stdout, so results can be collected and compared between versions. mb_per_sec is
+// the run text going in for build, paragraph_get and docx_get, and the compressed bytes coming
+// out for package_parts and save. Every scenario runs in a child process of its own and the peak
+// memory is reset before every phase, so peak_rss_kb is the phase's own.
+//
+// Usage: ./bench [scale] [min_seconds]
+//   scale        multiplies the size of the generated documents, default 1
+//   min_seconds  each phase is repeated until it has run at least this long, default 1
+
+#include "docx.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+struct Scenario {
+    std::string name;
+    std::vector<DOCX::Paragraph> paragraphs;
+    size_t text_bytes = 0;
+};
+
+static std::string random_words(Scenario& scenario, std::mt19937& rng, size_t count) {
+    static const char* words[] = {
+        "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit", "sed", "do",
+        "eiusmod", "tempor", "incididunt", "ut", "labore", "et", "dolore", "magna", "aliqua", "<&>"
+    };
+    std::string str;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0) {
+            str += ' ';
+        }
+        str += words[rng() % (sizeof(words) / sizeof(words[0]))];
+    }
+    scenario.text_bytes += str.size();
+    return str;
+}
+
+// Many paragraphs with a few short plain or bold runs each, like a long report
+static Scenario short_paragraphs(size_t scale) {
+    std::mt19937 rng(1);
+    Scenario scenario;
+    scenario.name = "short_paragraphs";
+    for (size_t i = 0; i < 20000 * scale; i++) {
+        DOCX::Paragraph& p = scenario.paragraphs.emplace_back();
+        p.add_plain_text(random_words(scenario, rng, 1 + rng() % 8));
+        if (rng() % 2 == 0) {
+            p.add_space();
+            p.add_bold_text(random_words(scenario, rng, 1 + rng() % 3));
+        }
+    }
+    return scenario;
+}
+
+// A few paragraphs with thousands of long runs each
+static Scenario huge_paragraphs(size_t scale) {
+    std::mt19937 rng(2);
+    Scenario scenario;
+    scenario.name = "huge_paragraphs";
+    for (size_t i = 0; i < 4 * scale; i++) {
+        DOCX::Paragraph& p = scenario.paragraphs.emplace_back();
+        p.align = DOCX::Paragraph::JUSTIFIED;
+        for (size_t j = 0; j < 5000; j++) {
+            p.add_plain_text(random_words(scenario, rng, 20));
+            p.add_space();
+        }
+    }
+    return scenario;
+}
+
+// Every run has its own mix of typeface, size, color, highlight and background
+static Scenario formatted_runs(size_t scale) {
+    static const char* typefaces[] = { "", "Arial", "Courier New", "Times New Roman" };
+    static const char* colors[] = { "", "FF0000", "00FF00", "0000FF", "808080" };
+    static const char* highlights[] = { "", "yellow", "green", "cyan" };
+
+    std::mt19937 rng(3);
+    Scenario scenario;
+    scenario.name = "formatted_runs";
+    for (size_t i = 0; i < 5000 * scale; i++) {
+        DOCX::Paragraph& p = scenario.paragraphs.emplace_back();
+        for (size_t j = 0; j < 12; j++) {
+            DOCX::Text& t = p.emplace_text(random_words(scenario, rng, 1 + rng() % 4));
+            t.bold = rng() % 2 == 0;
+            t.italic = rng() % 3 == 0;
+            t.underline = rng() % 5 == 0;
+            t.strikethrough = rng() % 11 == 0;
+            t.size = 9 + rng() % 8;
+            t.set_typeface(typefaces[rng() % 4]);
+            t.set_color(colors[rng() % 5]);
+            t.set_highlight(highlights[rng() % 4]);
+            t.set_bg_color(colors[rng() % 5]);
+            t.preserve_space = true;
+        }
+    }
+    return scenario;
+}
+
+// Writing 5 to clear_refs sets the peak to the current resident size (Linux 4.0 and later)
+static void reset_peak_rss() {
+#ifdef __GLIBC__
+    malloc_trim(0); // memory freed by the previous phase would still be resident otherwise
+#endif
+    std::ofstream("/proc/self/clear_refs") << "5";
+}
+
+// VmHWM follows reset_peak_rss(), ru_maxrss never goes down so it's only the fallback
+static long peak_rss_kb() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            return std::strtol(line.c_str() + 6, nullptr, 10);
+        }
+    }
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Runs fn until min_seconds have passed, fn returns the number of bytes it produced
+template <typename Fn>
+static void run_phase(const std::string& scenario, const std::string& phase, double min_seconds, Fn fn) {
+    typedef std::chrono::steady_clock clock;
+
+    size_t iterations = 0;
+    size_t bytes = 0;
+    double seconds = 0;
+    reset_peak_rss();
+    clock::time_point start = clock::now();
+    while (iterations == 0 || seconds < min_seconds) {
+        bytes += fn();
+        iterations++;
+        seconds = std::chrono::duration<double>(clock::now() - start).count();
+    }
+
+    std::printf("{\"scenario\":\"%s\",\"phase\":\"%s\",\"iterations\":%zu,\"seconds\":%.6f,"
+        "\"docs_per_sec\":%.3f,\"mb_per_sec\":%.3f,\"bytes_per_doc\":%zu,\"peak_rss_kb\":%ld}\n",
+        scenario.c_str(), phase.c_str(), iterations, seconds,
+        iterations / seconds, bytes / seconds / 1e6, bytes / iterations, peak_rss_kb());
+    std::fflush(stdout);
+}
+
+static void run_scenario(Scenario& scenario, double min_seconds) {
+    DOCX docx;
+
+    run_phase(scenario.name, "build", min_seconds, [&]() {
+        docx = DOCX();
+        for (size_t i = 0; i < scenario.paragraphs.size(); i++) {
+            docx.add_paragraph(scenario.paragraphs[i]);
+        }
+        return scenario.text_bytes;
+    });
+
+    run_phase(scenario.name, "paragraph_get", min_seconds, [&]() {
+        DOCX::Settings settings = DOCX::default_settings();
+        for (size_t i = 0; i < scenario.paragraphs.size(); i++) {
+            scenario.paragraphs[i].get(settings);
+        }
+        return scenario.text_bytes;
+    });
+
+    run_phase(scenario.name, "docx_get", min_seconds, [&]() {
+        docx.get();
+        return scenario.text_bytes;
+    });
+
+    // The parts as save() gets them, mostly from the caches
+    DOCX::FormatTable formats;
+    if (docx.settings.intern_run_formats) {
+        for (size_t i = 0; i < scenario.paragraphs.size(); i++) {
+            scenario.paragraphs[i].intern_formats(formats, docx.settings);
+        }
+    }
+    run_phase(scenario.name, "package_parts", min_seconds, [&]() {
+        size_t bytes = 0;
+        auto add = [&bytes](const std::string&, const DOCXZip::Compressed& content) {
+            bytes += content.data.size();
+        };
+        DOCX::add_fixed_parts(docx.settings, add);
+        DOCX::add_styles_part(docx.settings, formats, add);
+        return bytes;
+    });
+
+    std::string package;
+    run_phase(scenario.name, "save", min_seconds, [&]() {
+        package.clear();
+        docx.save_to_buffer(package);
+        return package.size();
+    });
+}
+
+int main(int argc, char** argv) {
+    size_t scale = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1;
+    double min_seconds = argc > 2 ? std::strtod(argv[2], nullptr) : 1;
+    if (scale == 0) {
+        std::cerr << "Scale must be a positive integer" << newl;
+        return 1;
+    }
+
+    // Each scenario is generated in its child, so it doesn't count towards the peaks of the others
+    Scenario (*scenarios[])(size_t) = { short_paragraphs, huge_paragraphs, formatted_runs };
+    for (size_t i = 0; i < 3; i++) {
+        std::fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "Could not start a process for the scenario" << newl;
+            return 1;
+        }
+        if (pid == 0) {
+            Scenario scenario = scenarios[i](scale);
+            run_scenario(scenario, min_seconds);
+            std::fflush(stdout);
+            _exit(0);
+        }
+        int status = 0;
+        if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            std::cerr << "Scenario failed" << newl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -1 +1,9 @@
-g++ main.cpp -o main
\ No newline at end of file
+if [ "$1" = "bench" ]; then
+    g++ -O2 bench.cpp -o bench -lz -pthread
+elif [ "$1" = "extract_text" ]; then
+    g++ -O2 extract_text.cpp -o extract_text -lz -pthread
+elif [ "$1" = "tests" ]; then
+    g++ -g -fsanitize=address tests.cpp -o tests -lz -pthread
+else
+    g++ main.cpp -o main -lz -pthread
+fi
@@ -19,39 +19,542 @@ If not, see <https://www.gnu.org/licenses/>.
 #include "../xml/xml.hpp"
 
 #include <string>
-#include <cstdlib>
+#include <vector>
+#include <memory_resource>
+#include <fstream>
+#include <ostream>
+#include <cstdint>
+#include <climits>
+#include <functional>
+#include <string_view>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <random>
 #include <filesystem>
+#include <chrono>
+#include <optional>
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+#include <cstring>
+#include <cctype>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <zlib.h>
 
 inline constexpr const char* newl = "\n";
 
+class DOCXZip;
+class DOCXZipReader;
+class DOCXXmlReader;
+class DOCXTextExtractor;
+
+//////////////////////////////////
+// DOCX Allocations declaration //
+//////////////////////////////////
+
+// Counts heap allocations per library phase. Nothing is counted unless one translation unit of the
+// program defines DOCX_COUNT_ALLOCATIONS before including this file, which replaces the global
+// operator new and delete with counting ones. zlib's allocations are counted too.
+class DOCXAllocations {
+public:
+    struct Counts {
+        size_t calls = 0; // times the phase ran
+        size_t allocations = 0;
+        size_t bytes = 0; // allocated in total
+        size_t peak_bytes = 0; // most memory held at once, above what was held when the phase started
+    };
+
+    // While a scope is alive, allocations made on its thread and on the threads the library starts
+    // meanwhile count towards it and the scopes it's nested in. Named scopes add their counts to
+    // totals() when they end. Scopes on a thread must end in the reverse order they started.
+    class Scope {
+    public:
+        Scope(const char* set_phase = nullptr);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        Counts counts() const;
+
+    private:
+        friend class DOCXAllocations;
+
+        const char* phase;
+        Scope* parent = nullptr;
+        bool active = false;
+        std::atomic<size_t> allocations{0};
+        std::atomic<size_t> bytes{0};
+        std::atomic<ptrdiff_t> current{0}; // below zero if memory from before the scope was freed
+        std::atomic<ptrdiff_t> peak{0};
+    };
+
+    // Used by threads the library starts, so that they count towards the scope of the thread that started them
+    class ThreadScope {
+    public:
+        ThreadScope(Scope* scope);
+        ~ThreadScope();
+
+        ThreadScope(const ThreadScope&) = delete;
+        ThreadScope& operator=(const ThreadScope&) = delete;
+
+    private:
+        Scope* previous;
+    };
+
+    static void set_enabled(bool set_enabled); // done by DOCX_COUNT_ALLOCATIONS
+    static bool enabled();
+    static Scope* current_scope();
+    static std::map<std::string, Counts> totals(); // of named scopes, by phase
+    static void reset_totals();
+
+    // Called by the counting operator new and delete
+    static void count_allocation(size_t size);
+    static void count_deallocation(size_t size);
+
+    // For z_stream::zalloc and z_stream::zfree
+    static void* zlib_alloc(void* opaque, unsigned items, unsigned size);
+    static void zlib_free(void* opaque, void* ptr);
+
+    static constexpr size_t HEADER_SIZE = alignof(std::max_align_t); // the size of a counted block is stored in front of it
+
+private:
+    static Scope*& thread_scope();
+
+    inline static std::atomic<bool> counting{false};
+    inline static std::mutex totals_mutex;
+    inline static std::map<std::string, Counts> phase_totals;
+};
+
+//////////////////////////
+// DOCX Zip declaration //
+//////////////////////////
+
+// Minimal ZIP writer that packs the in-memory package parts into a .docx archive
+class DOCXZip {
+public:
+    typedef std::function<void(const char* data, size_t len)> Sink;
+
+    struct Entry {
+        std::string name;
+        uint16_t flags = 0;
+        uint16_t method = 0;
+        uint32_t crc = 0;
+        uint64_t compressed_size = 0;
+        uint64_t size = 0;
+        uint64_t offset = 0;
+        double seconds = 0; // time spent compressing and writing it
+    };
+
+    // A part that has already been compressed, so it can be written any number of times
+    struct Compressed {
+        uint16_t method = 0;
+        uint32_t crc = 0;
+        uint64_t size = 0;
+        std::string data;
+    };
+
+    DOCXZip(Sink set_sink);
+
+    void set_thread_count(size_t count); // threads used to compress large parts added with add_file()
+    void add_file(const std::string& name, const std::string& content);
+    void add_file(const std::string& name, const Compressed& compressed);
+    // An entry whose data is already compressed with method, like one copied from another archive.
+    // The data is written as it is, one piece after the other. Of flags only the bit that marks
+    // the name as UTF-8 is kept, the others describe how the original was written.
+    void add_raw_file(const std::string& name, uint16_t method, uint32_t crc, uint64_t size, const std::vector<std::string_view>& data, uint16_t flags = 0);
+    void finish();
+
+    static Compressed compress(std::string_view content);
+    static Compressed compress(std::string_view content, uint32_t crc);
+    static Compressed compress_parallel(std::string_view content, size_t workers);
+    // Looks content up in a cache shared by the whole process, by hash, CRC and size and then the
+    // content itself, and only compresses it if it isn't there yet. For small parts that are the
+    // same in many documents.
+    static std::shared_ptr<const Compressed> compress_cached(std::string_view content);
+
+    // For parts put together from pieces, like the documents rendered by DOCX::Template: every
+    // piece ends on a byte boundary, so pieces compressed once can be joined in any order with
+    // pieces that are only known later. Start with an empty Compressed and finish it with end_pieces().
+    static Compressed compress_piece(std::string_view content);
+    static void append_piece(Compressed& part, const Compressed& piece);
+    static void append_stored_piece(Compressed& part, std::string_view content); // not compressed, for short pieces
+    static void end_pieces(Compressed& part);
+
+    // For parts whose size isn't known in advance: data is deflated as it arrives and the
+    // sizes and CRC are written in a data descriptor after it
+    void begin_file(const std::string& name);
+    void write_file_data(const char* data, size_t len);
+    void end_file();
+
+    const std::vector<Entry>& get_entries() const; // entries written so far
+    size_t bytes_written() const;
+
+    static constexpr size_t WINDOW_SIZE = 1 << 15; // 32 KiB, the largest distance deflate can refer back to
+
+private:
+    Sink sink;
+    std::vector<Entry> entries;
+    uint64_t offset = 0;
+    size_t thread_count = 1;
+
+    Entry cur_entry; // entry being streamed with begin_file()
+    std::chrono::steady_clock::time_point cur_entry_start;
+    z_stream strm = {};
+    bool strm_ready = false; // stored blocks are written instead if deflate couldn't be initialized
+    std::vector<char> strm_out;
+
+    void write(const std::string& data);
+    void write(const char* data, size_t len);
+    void write_local_header(const Entry& entry);
+    void deflate_stream(int flush);
+    // False if deflate couldn't be initialized, out is then left empty
+    static bool deflate_raw(std::string_view content, std::string& out);
+    static bool deflate_block(std::string_view dictionary, std::string_view block, bool last, std::string& out);
+    static void append_stored_blocks(std::string& out, std::string_view content, bool last); // deflate blocks that aren't compressed
+    static void put16(std::string& out, uint16_t val);
+    static void put32(std::string& out, uint32_t val);
+    static void put64(std::string& out, uint64_t val);
+    static bool needs_zip64(uint64_t val);
+
+    static constexpr uint16_t FLAG_DATA_DESCRIPTOR = 1 << 3;
+    static constexpr uint16_t FLAG_UTF8_NAME = 1 << 11;
+    static constexpr uint16_t VERSION_DEFAULT = 20; // 2.0, deflate
+    static constexpr uint16_t VERSION_ZIP64 = 45; // 4.5, ZIP64 extensions
+    static constexpr uint16_t ZIP64_EXTRA_ID = 0x0001;
+    static constexpr uint16_t METHOD_STORE = 0;
+    static constexpr uint16_t METHOD_DEFLATE = 8;
+    static constexpr uint16_t DOS_TIME = 0; // 00:00:00
+    static constexpr uint16_t DOS_DATE = (1 << 5) | 1; // 1980-01-01, fixed so that output is reproducible
+    static constexpr size_t PARALLEL_BLOCK_SIZE = 1 << 17; // 128 KiB
+    static constexpr size_t STORED_BLOCK_SIZE = 0xFFFF; // the most a stored deflate block can hold
+    static constexpr size_t COMPRESSED_CACHE_SIZE = 64; // entries
+    static constexpr size_t COMPRESSED_CACHE_MAX_PART_SIZE = 1 << 18; // larger parts aren't cached
+};
+
+/////////////////////////////////
+// DOCX Zip Reader declaration //
+/////////////////////////////////
+
+// Reads the entries of a ZIP archive through its central directory. Files are memory mapped, so
+// only the parts of the archive that are actually read are loaded.
+class DOCXZipReader {
+public:
+    struct Entry {
+        std::string name;
+        uint16_t flags = 0;
+        uint16_t method = 0;
+        uint32_t crc = 0;
+        uint64_t compressed_size = 0;
+        uint64_t size = 0;
+        uint64_t offset = 0; // of the local header
+    };
+
+    DOCXZipReader() = default;
+    ~DOCXZipReader();
+
+    DOCXZipReader(const DOCXZipReader&) = delete;
+    DOCXZipReader& operator=(const DOCXZipReader&) = delete;
+
+    bool open(const std::string& fname);
+    bool open(std::string_view buffer); // buffer has to outlive the reader
+    void close();
+
+    const std::vector<Entry>& get_entries() const;
+    const Entry* find(std::string_view name) const; // nullptr if there's no such entry
+    std::string_view compressed_data(const Entry& entry) const; // empty if the local header is broken
+    bool read(const Entry& entry, std::string& out) const; // out is replaced with the contents
+    // Passes the contents to sink in pieces of at most READ_CHUNK_SIZE bytes as they are inflated.
+    // False if the entry turns out to be broken, possibly after some of it was passed on.
+    bool read(const Entry& entry, std::function<void(const char* data, size_t len)> sink) const;
+
+    static constexpr size_t READ_CHUNK_SIZE = 1 << 16;
+
+private:
+    std::string_view data;
+    std::vector<Entry> entries;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+    std::string file_contents; // where the file is read to where it can't be mapped
+
+    bool read_central_directory();
+    bool read_zip64_end(size_t eocd, size_t& count, size_t& cd_size, size_t& cd_offset, size_t& cd_end) const;
+    static bool read_zip64_extra(std::string_view extra, Entry& entry);
+    static uint16_t get16(const char* p);
+    static uint32_t get32(const char* p);
+    static uint64_t get64(const char* p);
+
+    static constexpr size_t EOCD_SIZE = 22;
+    static constexpr size_t ZIP64_LOCATOR_SIZE = 20;
+    static constexpr size_t ZIP64_EOCD_SIZE = 56;
+    static constexpr size_t CD_HEADER_SIZE = 46;
+    static constexpr size_t LOCAL_HEADER_SIZE = 30;
+    static constexpr size_t MAX_DEFLATE_RATIO = 1032; // the most deflate can expand its input
+};
+
 //////////////////////
 // DOCX declaration //
 //////////////////////
 
 class DOCX {
 public:
-    DOCX() = default;
+    // Document wide settings, every document has its own copy so documents with different
+    // settings can be built and saved at the same time
+    struct Settings {
+        size_t font_size = 12;
+        std::string latin_typeface = "Georgia";
+        std::string ea_typeface = "Noto Serif JP";
+        std::string cs_typeface = "Noto Serif JP";
+        bool intern_run_formats = false; // write every distinct run format once as a character style in styles.xml
+        bool coalesce_runs = false; // write neighboring runs with the same format as a single run
+        bool compact_markup = false; // leave out paragraph and run properties that match the defaults in styles.xml
+        // Write the default size and typefaces into every run, so that the runs look the same in a
+        // document whose styles.xml has other defaults. Overrides compact_markup for runs.
+        bool explicit_run_defaults = false;
+    };
+
+    // Where the time of a save went, see set_save_stats_callback()
+    struct SaveStats {
+        struct Entry {
+            std::string name;
+            double seconds = 0;
+            size_t bytes = 0; // uncompressed
+            size_t compressed_bytes = 0; // 0 if nothing was compressed
+            size_t allocations = 0; // allocation counts are only filled in if DOCXAllocations is enabled
+            size_t allocated_bytes = 0;
+            size_t peak_bytes = 0;
+        };
+
+        std::vector<Entry> phases; // in the order they ran
+        std::vector<Entry> parts; // package parts in the order they were written, cached parts only count the time to write them
+        double seconds = 0; // the whole save
+        size_t bytes = 0; // size of the package
+        size_t allocations = 0;
+        size_t allocated_bytes = 0;
+        size_t peak_bytes = 0;
+    };
+
+    DOCX();
+    DOCX(Settings set_settings);
+    // The stored text, runs and paragraph records are allocated from an arena owned by the document, which
+    // grows in blocks of at least arena_block_size bytes and is only freed as a whole by clear()
+    // or the destructor
+    DOCX(Settings set_settings, size_t arena_block_size);
+
+    static Settings default_settings(); // settings with the typefaces currently set in DOCXUtils
 
     class Paragraph;
     class Text;
+    class StreamWriter;
+    class FormatTable;
+    class Template;
 
-    void add_paragraph(DOCX::Paragraph paragraph);
+    Settings settings;
+
+    void add_paragraph(const DOCX::Paragraph& paragraph);
+    void add_paragraph(DOCX::Paragraph&& paragraph);
+    template <typename... Args>
+    DOCX::Paragraph& emplace_paragraph(Args&&... args); // constructs in place, the reference is valid until the next paragraph is added, clear() or load()
     void add_empty_line(size_t count = 1, size_t font_size = 0);
+    size_t paragraph_count();
+    DOCX::Paragraph get_paragraph(size_t index); // a copy, changing it doesn't change the document
+    void set_paragraph(size_t index, const DOCX::Paragraph& paragraph); // replaces an existing paragraph
+    void clear(); // removes all paragraphs and frees the arena if there is one and no copy shares it
+    XML::Node get(); // word/document.xml as XML nodes, save() writes the same without building them
     void print();
     void save(std::string fname);
-    void set_global_font_size(size_t set_size); // TODO not used yet
+    void save(std::ostream& os);
+    void save(std::function<void(const char* data, size_t len)> sink);
+    void save_to_buffer(std::vector<char>& buffer);
+    void save_to_buffer(std::string& buffer);
+    // Replace the paragraphs of the document with those of an existing .docx, and the typefaces
+    // and font size in settings with its defaults. False if it couldn't be read.
+    bool load(std::string fname);
+    bool load_from_buffer(std::string_view buffer); // buffer only has to live until it returns
+    // Adds the paragraphs of this document to the end of the body of an existing .docx. Only
+    // word/document.xml and docProps/app.xml are rewritten, the other entries are copied without
+    // inflating them. Runs get direct formatting since the styles of the other document aren't
+    // known. False if the file couldn't be read or written.
+    bool append_to(std::string fname);
+    void set_global_font_size(size_t set_size); // same as setting settings.font_size
     size_t get_global_font_size();
+    void set_thread_count(size_t count); // threads used to serialize and compress when saving, 0 means all hardware threads
+    size_t get_thread_count();
+    // Keeps word/document.xml compressed in chunks of paragraphs between saves, so that saving
+    // again after changing a few paragraphs only serializes and compresses the chunks they are in.
+    // The XML is the same as without it, it's only compressed in more pieces.
+    void set_incremental_save(bool enabled);
+    // Stores paragraphs that are added again with the same contents and formatting only once, and
+    // copies their XML from the first one when saving instead of serializing them again. Costs a
+    // hash of every added paragraph and an index entry for every distinct one.
+    void set_dedupe_paragraphs(bool enabled);
+    // Called with the stats of every save that follows, stats are only collected while a callback is set
+    void set_save_stats_callback(std::function<void(const SaveStats& stats)> callback);
+    // The parts of the package other than word/document.xml, compressed as save() writes them. add
+    // is called with the name and the compressed contents of each part. formats are the interned
+    // run formats, empty unless settings.intern_run_formats is set.
+    template <typename AddPart>
+    static void add_fixed_parts(const Settings& settings, AddPart add);
+    template <typename AddPart>
+    static void add_styles_part(const Settings& settings, const FormatTable& formats, AddPart add);
 
 private:
-    std::vector<DOCX::Paragraph> paragraphs;
+    // Copies and moves share the arena so that it lives as long as any container allocating from
+    // it. Assignment leaves it alone since assigned paragraphs are copied into this document's memory.
+    // Only the last document using the arena may release it.
+    struct ArenaRef {
+        std::shared_ptr<std::pmr::monotonic_buffer_resource> resource;
+
+        ArenaRef() = default;
+        ArenaRef(std::shared_ptr<std::pmr::monotonic_buffer_resource> set_resource) : resource(set_resource) {}
+        ArenaRef(const ArenaRef& other) : resource(other.resource) {}
+        ArenaRef& operator=(const ArenaRef&) { return *this; }
+    };
 
-    XML::Node get();
-    void generate_docx_template();
-    void zip_docx_template(std::string fname);
-    void delete_docx_template();
+    // Paragraphs are not kept as Paragraph objects but packed: the text of all runs is in one
+    // buffer, a run is a small record that points into it and refers to its format by index, every
+    // distinct format is stored once, and a paragraph is a range of runs
+    struct RunRecord {
+        uint64_t text_offset;
+        uint32_t text_size;
+        uint32_t format : 31; // index into formats
+        uint32_t preserve_space : 1;
+    };
+
+    struct ParagraphRecord {
+        uint64_t typeface_offset; // the typeface is kept in text too
+        uint32_t typeface_size;
+        uint32_t first_run;
+        uint32_t run_count;
+        uint32_t default_font_size;
+        uint32_t same_as; // 1 + the index of an earlier paragraph whose text and runs this one shares, 0 if none
+        uint8_t align;
+    };
+
+    ArenaRef arena; // declared before the containers below so that it is destroyed after them
+    std::pmr::string text;
+    std::pmr::vector<RunRecord> runs;
+    std::pmr::vector<ParagraphRecord> records;
+    std::pmr::vector<DOCX::Text> formats; // text of these is left empty
+    std::pmr::unordered_multimap<size_t, uint32_t> format_ids_by_hash;
+    std::pmr::unordered_multimap<size_t, uint32_t> paragraph_ids_by_hash; // only filled in while deduplicating
+    // How many paragraphs use the text and runs at a storage_key(), only for those used by more than one
+    std::pmr::map<std::pair<uint64_t, uint32_t>, uint32_t> shared_storage;
+    bool dedupe_paragraphs = false;
+    // The paragraph from emplace_paragraph(), kept until the next one is added since the caller may
+    // still change it. Once packed it's the last record and packed_pending has what that was made from.
+    std::vector<DOCX::Paragraph> pending;
+    std::vector<DOCX::Paragraph> packed_pending;
+    size_t replaced_text_size = 0; // text and runs of paragraphs replaced by set_paragraph(), still in the buffers
+    size_t replaced_run_count = 0;
+    size_t thread_count = 1;
+    std::function<void(const SaveStats& stats)> save_stats_callback;
+
+    // A piece of word/document.xml as compressed by the last save, see set_incremental_save()
+    struct DocumentChunk {
+        size_t first_paragraph;
+        size_t paragraph_count;
+        bool changed; // compressed again by the next save
+        DOCXZip::Compressed compressed;
+    };
+
+    struct ChunkCache {
+        bool enabled = false;
+        Settings settings; // the chunks were written with, they are all thrown away when these change
+        std::vector<DocumentChunk> chunks; // in order, paragraphs after the last one were added since
+    };
+
+    ChunkCache chunk_cache;
+
+    // Adds a phase to stats, if it's not null, every time end() is called. The sizes of the parts
+    // written to zip since the previous phase are added to the phase.
+    class PhaseTimer {
+    public:
+        PhaseTimer(SaveStats* set_stats, const DOCXZip& set_zip);
+        void end(const char* name, size_t extra_bytes = 0);
+
+    private:
+        SaveStats* stats;
+        const DOCXZip& zip;
+        size_t first_entry;
+        std::chrono::steady_clock::time_point start;
+        std::optional<DOCXAllocations::Scope> scope;
+    };
+
+    void pack(const DOCX::Paragraph& paragraph, size_t index = SIZE_MAX); // index is where the record will end up, the end by default
+    void pack_pending(); // makes the pending paragraph the last record, it stays pending
+    void finish_pending(); // before the next paragraph is added
+    void replace_paragraph(size_t index, const DOCX::Paragraph& paragraph);
+    static bool same_paragraph(const DOCX::Paragraph& a, const DOCX::Paragraph& b);
+    void dedupe_last(uint32_t index);
+    void unindex_paragraph(uint32_t index);
+    size_t paragraph_hash(const ParagraphRecord& record) const;
+    bool same_contents(const ParagraphRecord& a, const ParagraphRecord& b) const;
+    static bool same_storage(const ParagraphRecord& a, const ParagraphRecord& b);
+    static std::pair<uint64_t, uint32_t> storage_key(const ParagraphRecord& record);
+    static bool has_storage(const ParagraphRecord& record);
+    void compact();
+    uint32_t intern_format(const DOCX::Text& t);
+    size_t estimate_xml_size(size_t index) const;
+    void write_paragraph(size_t index, std::string& out, const Settings& write_settings, const size_t* style_ids) const;
+    void write_paragraphs(size_t begin, size_t end, std::string& out, const Settings& write_settings, const size_t* style_ids) const;
+
+    typedef std::map<std::string, DOCX::Text, std::less<>> CharacterStyles; // by style id
+
+    bool load_package(const DOCXZipReader& zip);
+    void read_styles(std::string_view xml, CharacterStyles& styles);
+    void read_document(std::string_view xml, const CharacterStyles& styles);
+    static void read_run_property(const DOCXXmlReader& xml, DOCX::Text& format, const CharacterStyles& styles);
+    static bool in_property_change(const DOCXXmlReader& xml, size_t& change_depth);
+
+    // word/document.xml of a package being appended to: prefix is the part of the old compressed
+    // data that is kept as it is and tail is compressed data that continues it
+    struct AppendedDocument {
+        uint16_t method = 0;
+        uint32_t crc = 0;
+        size_t size = 0;
+        std::string_view prefix;
+        std::string tail;
+    };
+
+    static bool append_to_document(const DOCXZipReader& zip, const DOCXZipReader::Entry& entry, std::string_view body, size_t workers, AppendedDocument& out);
+    static bool splice_document(std::string_view compressed, const DOCXZipReader::Entry& entry, std::string_view body, AppendedDocument& out);
+    static size_t body_insert_position(std::string_view xml); // npos if there's no </w:body>
+    void update_app_properties(std::string& xml) const;
+    static void add_to_count(std::string& xml, std::string_view tag, size_t count);
+
+    void write_document(std::string& out, const size_t* style_ids);
+    void write_paragraphs_parallel(std::string& out, size_t workers, const size_t* style_ids);
+    DOCXZip::Compressed write_document_chunks(const size_t* style_ids);
+    void split_chunk(std::vector<DocumentChunk>& chunks, size_t first_paragraph, size_t paragraph_count) const;
+    static bool same_output(const Settings& a, const Settings& b);
+    size_t worker_count();
+    void save_package(std::function<void(const char* data, size_t len)> sink, SaveStats* stats);
+    static void add_allocation_counts(SaveStats& stats, const DOCXAllocations::Scope& scope);
+    void write_package(DOCXZip& zip, SaveStats* stats);
+    void intern_formats(FormatTable& styles, std::vector<size_t>& style_ids);
+    static void write_fixed_parts(DOCXZip& zip, const Settings& settings);
+    static void write_styles_part(DOCXZip& zip, const Settings& settings, const FormatTable& formats);
 
-    static size_t global_font_size;
     static XML::Node root_node();
+    static std::string document_prolog();
+    static std::string document_epilog();
+
+    static constexpr size_t PARALLEL_MIN_PARAGRAPHS = 1024; // below this, starting threads costs more than it saves
+    static constexpr size_t DOCUMENT_CHUNK_SIZE = 1 << 17; // 128 KiB of XML, about
 };
 
 ///////////////////////////
@@ -74,19 +577,35 @@ public:
     alignment align = AUTO;
     std::string typeface = "";
 
-    void add_text(Text t);
-    void add_text(std::string text_str);
-    void add_formatted_text(Text t);
-    void add_plain_text(std::string text_str);
+    void add_text(const Text& t);
+    void add_text(Text&& t);
+    void add_text(std::string_view text_str);
+    template <typename... Args>
+    DOCX::Text& emplace_text(Args&&... args); // constructs in place, the reference is valid until the next text is added
+    void add_formatted_text(const Text& t);
+    void add_formatted_text(Text&& t);
+    void add_plain_text(std::string_view text_str);
     void add_space(size_t count = 1, size_t font_size = 0); // 0 to follow global setting
-    void add_bold_text(std::string text_str);
-    void add_italic_text(std::string text_str);
-    void add_underlined_text(std::string text_str);
-    void add_struckthrough_text(std::string text_str);
+    void add_bold_text(std::string_view text_str);
+    void add_italic_text(std::string_view text_str);
+    void add_underlined_text(std::string_view text_str);
+    void add_struckthrough_text(std::string_view text_str);
+    void coalesce(); // merges neighboring runs with the same format into one
     XML::Node get();
+    XML::Node get(const DOCX::Settings& settings);
+    // Appends the serialized w:p element to out, runs refer to their styles in formats if it's given
+    void write(std::string& out, const DOCX::Settings& settings, const DOCX::FormatTable* formats = nullptr) const;
+    void intern_formats(DOCX::FormatTable& formats, const DOCX::Settings& settings) const;
 
 private:
+    friend class DOCX; // packs and unpacks contents
+
     std::vector<DOCX::Text> contents;
+
+    // Shared with DOCX::write_paragraph(), which writes the same markup from the packed records
+    static void write_properties(std::string& out, const DOCX::Settings& settings, alignment align, size_t default_font_size, std::string_view typeface);
+    // Appends everything up to the text of the run, which is followed by </w:t></w:r>
+    static void write_run_start(std::string& out, const DOCX::Settings& settings, const DOCX::Text& format, size_t style_id, bool preserve_space);
 };
 
 //////////////////////
@@ -96,7 +615,20 @@ private:
 class DOCX::Text {
 public:
     Text() = default;
-    Text(std::string set_text);
+    Text(std::string_view set_text);
+
+    // Assign in place, reusing the memory the strings already have
+    void set_text(std::string_view set_text);
+    void set_typeface(std::string_view set_typeface);
+    void set_color(std::string_view set_color);
+    void set_highlight(std::string_view set_highlight);
+    void set_bg_color(std::string_view set_bg_color);
+
+    bool same_format(const Text& other) const; // true if everything but the text itself is the same
+    void copy_format(const Text& other); // copies everything but the text itself
+    size_t format_hash() const; // same for texts with the same format
+    bool has_properties(const DOCX::Settings& settings) const; // false if the run only uses the document defaults
+    void write_properties(std::string& out, const DOCX::Settings& settings) const; // appends the children of w:rPr
 
     std::string text;
     std::string typeface = "";
@@ -111,187 +643,1492 @@ public:
     size_t size = 12;
 };
 
+/////////////////////////////
+// FormatTable declaration //
+/////////////////////////////
+
+// The distinct run formats of a document. Each one is written to styles.xml once as a character
+// style and runs only refer to it by id, see DOCX::Settings::intern_run_formats
+class DOCX::FormatTable {
+public:
+    static constexpr size_t NONE = SIZE_MAX;
+
+    size_t intern(const Text& t, const DOCX::Settings& settings); // NONE for runs without formatting
+    size_t find(const Text& t, const DOCX::Settings& settings) const;
+    size_t size() const;
+    void write_styles(std::string& out, const DOCX::Settings& settings) const; // appends the w:style elements
+
+    static void append_style_id(std::string& out, size_t id);
+
+private:
+    std::vector<Text> formats; // text of these is left empty
+    std::unordered_multimap<size_t, size_t> ids_by_hash;
+};
+
+/////////////////////////////////
+// DOCX XML Reader declaration //
+/////////////////////////////////
+
+// Pull parser for the XML in the package parts. next() moves to the next tag, nothing is built or
+// copied, names, attributes and text all point into the buffer.
+class DOCXXmlReader {
+public:
+    DOCXXmlReader(std::string_view set_xml);
+
+    bool next(); // false at the end
+    std::string_view name() const; // empty for comments, processing instructions and CDATA sections
+    bool is_start() const; // <name> or <name/>
+    bool is_end() const; // </name> or <name/>
+    std::string_view attribute(std::string_view attribute_name) const; // still escaped, empty if it's not there
+    std::string_view text() const; // the escaped character data between the previous tag and this one
+    std::string_view cdata() const; // contents of a CDATA section, which has an empty name
+    size_t parsed_size() const; // up to the end of the last tag next() moved to, the rest may be an incomplete tag
+
+    template <typename String>
+    static void append_unescaped(String& out, std::string_view str);
+
+private:
+    std::string_view xml;
+    size_t pos = 0;
+    size_t parsed = 0;
+    std::string_view tag_name;
+    std::string_view attributes;
+    std::string_view tag_text;
+    std::string_view tag_cdata;
+    bool closing = false;
+    bool self_closing = false;
+
+    static bool is_space(char c);
+    static size_t encode_utf8(uint32_t code_point, char* out); // returns the length, at most 4
+};
+
+/////////////////////////////////////
+// DOCX Text Extractor declaration //
+/////////////////////////////////////
+
+// Extracts the plain text of word/document.xml for search indexing etc. without building a
+// document. The part is inflated and scanned a chunk at a time, so memory use depends on the
+// longest paragraph and not on the size of the document.
+class DOCXTextExtractor {
+public:
+    // Called once per outermost w:p with its text, tabs are kept and line breaks become spaces
+    typedef std::function<void(std::string_view paragraph)> Sink;
+
+    DOCXTextExtractor(Sink set_sink);
+
+    // False if the file couldn't be read, the paragraphs before the error have been passed to sink by then
+    static bool extract(const std::string& fname, Sink sink);
+    static bool extract_from_buffer(std::string_view buffer, Sink sink);
+
+    void feed(const char* data, size_t len); // the next piece of word/document.xml
+    void finish(); // passes on the last paragraph if the XML ended inside it
+
+private:
+    Sink sink;
+    std::string pending; // an incomplete tag and the text before it, left over from the previous piece
+    std::string line;
+    size_t depth = 0; // of w:p elements, paragraphs in text boxes are added to the line of the paragraph they are in
+    size_t run_depth = 0;
+    bool in_text = false;
+
+    static bool extract_package(const DOCXZipReader& zip, Sink sink);
+    void handle(const DOCXXmlReader& reader);
+    void end_line();
+};
+
 ////////////////////////////
 // DOCX Utils declaration //
 ////////////////////////////
 
 class DOCXUtils {
 public:
+    // Defaults for the settings of new documents, DOCX::Settings is used when saving
     static std::string latin_typeface;
     static std::string ea_typeface;
     static std::string cs_typeface;
 
-    static void mkdir(std::string dirpath);
-    static void write_file(std::string fpath, std::string content);
-    static void delete_file_or_folder(std::string dirpath);
-
     static std::string content_types_file();
     static std::string dotrels_file();
     static std::string app_file();
     static std::string core_file();
     static std::string font_table_file();
+    static std::string font_table_file(const DOCX::Settings& settings);
     static std::string settings_file();
     static std::string styles_file();
+    static std::string styles_file(const DOCX::Settings& settings);
+    static std::string styles_file(const DOCX::Settings& settings, const DOCX::FormatTable& formats);
     static std::string document_xml_rels_file();
     static std::string theme1_file();
+    static std::string theme1_file(const DOCX::Settings& settings);
+
+    // Parts that never change, compressed once and reused by every save
+    struct ConstantParts {
+        DOCXZip::Compressed content_types;
+        DOCXZip::Compressed dotrels;
+        DOCXZip::Compressed settings;
+        DOCXZip::Compressed document_xml_rels;
+    };
+
+    // Parts that only depend on the typefaces and font size in DOCX::Settings, compressed once
+    // for every combination of those in use
+    struct StyleParts {
+        DOCXZip::Compressed font_table;
+        DOCXZip::Compressed styles;
+        DOCXZip::Compressed theme1;
+    };
+
+    static const ConstantParts& constant_parts();
+    static std::shared_ptr<const StyleParts> style_parts(const DOCX::Settings& settings);
+
+    static constexpr uint32_t crc32_of(std::string_view data);
+    static void append_escaped(std::string& out, std::string_view str);
+    static void append_uint(std::string& out, size_t val);
+    static size_t parse_uint(std::string_view str); // stops at the first character that isn't a digit
+
+    static double seconds_since(std::chrono::steady_clock::time_point start);
+    // Saving writes to a temp file next to the file a symlink points to and renames it over that
+    // file, which keeps the symlink and the permissions of the file it replaces
+    static std::string temp_fname_for(const std::string& fname);
+    static bool replace_file(const std::string& temp_fname, const std::string& fname, bool write_ok); // false if fname wasn't replaced
+    static std::string resolve_symlinks(const std::string& fname); // fname itself if it isn't a symlink
+
+private:
+    static constexpr std::string_view content_types_xml();
+    static constexpr std::string_view dotrels_xml();
+    static constexpr std::string_view settings_xml();
+    static constexpr std::string_view document_xml_rels_xml();
+    static constexpr std::string_view font_table_template();
+    static constexpr std::string_view styles_template();
+    static constexpr std::string_view theme1_template();
+
+    static std::string fill_template(std::string_view xml_template, const DOCX::Settings& settings);
+
+    static constexpr size_t STYLE_PARTS_CACHE_SIZE = 64;
+};
+
+//////////////////////////////
+// StreamWriter declaration //
+//////////////////////////////
+
+// Writes a document while it is being built: every paragraph is serialized and compressed
+// into the output as soon as it is added, so memory use doesn't grow with document length
+class DOCX::StreamWriter {
+public:
+    StreamWriter(std::string fname, DOCX::Settings set_settings = DOCX::default_settings());
+    StreamWriter(std::ostream& os, DOCX::Settings set_settings = DOCX::default_settings());
+    StreamWriter(std::function<void(const char* data, size_t len)> sink, DOCX::Settings set_settings = DOCX::default_settings());
+    ~StreamWriter();
+
+    StreamWriter(const StreamWriter&) = delete;
+    StreamWriter& operator=(const StreamWriter&) = delete;
+
+    void add_paragraph(const DOCX::Paragraph& paragraph);
+    void add_empty_line(size_t count = 1, size_t font_size = 0);
+    void close(); // finishes the package, called by the destructor if not called before
+
+private:
+    DOCX::Settings settings;
+    DOCX::FormatTable formats; // only filled in if settings.intern_run_formats is set
+    std::string fname; // empty unless writing to a file
+    std::string temp_fname;
+    std::ofstream ofs;
+    DOCXZip zip;
+    std::string buffer;
+    bool closed = false;
+
+    void begin();
+    void flush_buffer();
+
+    static constexpr size_t BUFFER_SIZE = 1 << 16;
+};
+
+//////////////////////////
+// Template declaration //
+//////////////////////////
+
+// A document compiled once and rendered any number of times with different field values, for
+// mail merge and the like. Every {{name}} in the text of a run is a field, names are made of
+// letters, digits, '_', '.' and '-'. A field has to be within one run, so its braces can't be
+// formatted differently from its name. The document is serialized and compressed when compiling,
+// rendering only escapes the values and joins them with the compressed pieces in between, and
+// every other part of the package is reused as it is.
+class DOCX::Template {
+public:
+    Template(DOCX& docx); // later changes to docx don't change the template
+
+    const std::vector<std::string>& get_fields() const; // in the order they first appear
+    size_t field_index(std::string_view name) const; // SIZE_MAX if there is no such field
+
+    // values are in the order of get_fields(), missing ones are left empty. Templates can be
+    // rendered from several threads at once.
+    void render(const std::vector<std::string_view>& values, std::string fname) const;
+    void render(const std::vector<std::string_view>& values, std::function<void(const char* data, size_t len)> sink) const;
+    void render_to_buffer(const std::vector<std::string_view>& values, std::string& buffer) const;
+
+private:
+    std::vector<std::pair<std::string, DOCXZip::Compressed>> parts; // all but word/document.xml
+    std::vector<DOCXZip::Compressed> segments; // of word/document.xml, around the slots
+    std::vector<size_t> slots; // field index of each slot, segments[i] comes before slots[i]
+    std::vector<std::string> fields;
+    size_t document_size = 0; // compressed, without the values
+
+    void add_part(const std::string& name, const DOCXZip::Compressed& content);
+    void compile_document(std::string_view document);
+    static size_t field_name_size(std::string_view str); // of the name at the start of str
 };
 
 //////////////////////
 // DOCX definitions //
 //////////////////////
 
-inline void DOCX::add_paragraph(DOCX::Paragraph paragraph) {
-    paragraphs.push_back(paragraph);
+inline DOCX::DOCX() {
+    settings = default_settings();
+}
+
+inline DOCX::DOCX(Settings set_settings) {
+    settings = set_settings;
+}
+
+inline DOCX::DOCX(Settings set_settings, size_t arena_block_size) :
+    arena(std::make_shared<std::pmr::monotonic_buffer_resource>(arena_block_size)),
+    text(arena.resource.get()),
+    runs(arena.resource.get()),
+    records(arena.resource.get()),
+    formats(arena.resource.get()),
+    format_ids_by_hash(arena.resource.get()),
+    paragraph_ids_by_hash(arena.resource.get()),
+    shared_storage(arena.resource.get())
+{
+    settings = set_settings;
+}
+
+inline void DOCX::add_paragraph(const DOCX::Paragraph& paragraph) {
+    DOCXAllocations::Scope scope("DOCX::add_paragraph");
+    finish_pending();
+    pack(paragraph);
+}
+
+inline void DOCX::add_paragraph(DOCX::Paragraph&& paragraph) {
+    DOCXAllocations::Scope scope("DOCX::add_paragraph");
+    finish_pending();
+    pack(paragraph);
+}
+
+template <typename... Args>
+DOCX::Paragraph& DOCX::emplace_paragraph(Args&&... args) {
+    DOCXAllocations::Scope scope("DOCX::emplace_paragraph");
+    finish_pending();
+    return pending.emplace_back(std::forward<Args>(args)...);
 }
 
 inline void DOCX::add_empty_line(size_t count, size_t font_size) {
+    finish_pending();
     for (size_t i = 0; i < count; i++) {
-        DOCX::Paragraph p;
-        p.default_font_size = font_size;
-        paragraphs.push_back(p);
+        ParagraphRecord& record = records.emplace_back();
+        record.typeface_offset = text.size();
+        record.first_run = runs.size();
+        record.default_font_size = font_size;
+        record.align = Paragraph::AUTO;
     }
 }
 
-inline void DOCX::print() {
-    get().print();
+inline size_t DOCX::paragraph_count() {
+    pack_pending();
+    return records.size();
 }
 
-inline void DOCX::save(std::string fname) {
-    generate_docx_template();
-    XML::Node root = get();
-    root.save("docx_temp/word/document.xml");
-    zip_docx_template(fname);
-    delete_docx_template();
+inline DOCX::Paragraph DOCX::get_paragraph(size_t index) {
+    pack_pending();
+    const ParagraphRecord& record = records.at(index);
+
+    DOCX::Paragraph paragraph;
+    paragraph.default_font_size = record.default_font_size;
+    paragraph.align = Paragraph::alignment(record.align);
+    paragraph.typeface.assign(text, record.typeface_offset, record.typeface_size);
+    paragraph.contents.reserve(record.run_count);
+    for (size_t i = record.first_run; i < record.first_run + record.run_count; i++) {
+        const RunRecord& run = runs[i];
+        DOCX::Text& t = paragraph.contents.emplace_back();
+        t.copy_format(formats[run.format]);
+        t.text.assign(text, run.text_offset, run.text_size);
+        t.preserve_space = run.preserve_space;
+    }
+    return paragraph;
 }
 
-// TODO not used yet
-inline void DOCX::set_global_font_size(size_t set_size) {
-    global_font_size = set_size;
+// The old text and runs stay in the buffers until there are as many of them as there are live
+// ones, then the buffers are compacted. Not with an arena though, it would only grow by that.
+inline void DOCX::set_paragraph(size_t index, const DOCX::Paragraph& paragraph) {
+    pack_pending();
+    if (!pending.empty() && index == records.size() - 1) { // the reference from emplace_paragraph() sees the new contents
+        pending.back() = paragraph;
+        pack_pending();
+        return;
+    }
+    replace_paragraph(index, paragraph);
 }
 
-inline size_t DOCX::get_global_font_size() {
-    return global_font_size;
+inline void DOCX::replace_paragraph(size_t index, const DOCX::Paragraph& paragraph) {
+    ParagraphRecord& old = records.at(index);
+    if (dedupe_paragraphs && old.same_as == 0) { // only paragraphs that aren't duplicates are indexed
+        unindex_paragraph(index);
+    }
+    auto shared = has_storage(old) ? shared_storage.find(storage_key(old)) : shared_storage.end();
+    if (shared != shared_storage.end()) { // other paragraphs still use the text and runs
+        if (--shared->second < 2) {
+            shared_storage.erase(shared);
+        }
+    } else {
+        replaced_run_count += old.run_count;
+        replaced_text_size += old.typeface_size;
+        if (old.run_count > 0) {
+            const RunRecord& last = runs[old.first_run + old.run_count - 1];
+            replaced_text_size += last.text_offset + last.text_size - runs[old.first_run].text_offset;
+        }
+    }
+
+    pack(paragraph, index);
+    records[index] = records.back();
+    records.pop_back();
+
+    std::vector<DocumentChunk>& chunks = chunk_cache.chunks;
+    auto chunk = std::upper_bound(chunks.begin(), chunks.end(), index, [](size_t i, const DocumentChunk& c) {
+        return i < c.first_paragraph;
+    });
+    if (chunk != chunks.begin() && index < (chunk - 1)->first_paragraph + (chunk - 1)->paragraph_count) {
+        (chunk - 1)->changed = true;
+    }
+
+    if (arena.resource == nullptr && replaced_text_size + replaced_run_count * sizeof(RunRecord) > (text.size() + runs.size() * sizeof(RunRecord)) / 2) {
+        compact();
+    }
 }
 
-inline XML::Node DOCX::get() {
-    XML::Node root = root_node();
-    XML::Node body("w:body");
+inline void DOCX::clear() {
+    // Swapping with empty containers that use the same resource, the old ones are destroyed
+    // before the arena releases the memory underneath them
+    pending.clear();
+    packed_pending.clear();
+    chunk_cache.chunks.clear();
+    replaced_text_size = replaced_run_count = 0;
+    std::pmr::string(text.get_allocator()).swap(text);
+    std::pmr::vector<RunRecord>(runs.get_allocator()).swap(runs);
+    std::pmr::vector<ParagraphRecord>(records.get_allocator()).swap(records);
+    std::pmr::vector<DOCX::Text>(formats.get_allocator()).swap(formats);
+    std::pmr::unordered_multimap<size_t, uint32_t>(format_ids_by_hash.get_allocator()).swap(format_ids_by_hash);
+    std::pmr::unordered_multimap<size_t, uint32_t>(paragraph_ids_by_hash.get_allocator()).swap(paragraph_ids_by_hash);
+    std::pmr::map<std::pair<uint64_t, uint32_t>, uint32_t>(shared_storage.get_allocator()).swap(shared_storage);
+    // A copy or a document moved from this one may still have its containers in the arena, then
+    // the memory is only given back when the last of them goes away
+    if (arena.resource != nullptr && arena.resource.use_count() == 1) {
+        arena.resource->release();
+    }
+}
 
-    // Add paragraphs
+inline void DOCX::pack(const DOCX::Paragraph& paragraph, size_t index) {
+    ParagraphRecord& record = records.emplace_back();
+    record.typeface_offset = text.size();
+    record.typeface_size = paragraph.typeface.size();
+    record.first_run = runs.size();
+    record.run_count = paragraph.contents.size();
+    record.default_font_size = paragraph.default_font_size;
+    record.align = paragraph.align;
+    text += paragraph.typeface;
+
+    for (size_t i = 0; i < paragraph.contents.size(); i++) {
+        const DOCX::Text& t = paragraph.contents[i];
+        RunRecord& run = runs.emplace_back();
+        run.text_offset = text.size();
+        run.text_size = t.text.size();
+        run.format = intern_format(t);
+        run.preserve_space = t.preserve_space;
+        text += t.text;
+    }
 
-    for (size_t i = 0; i < paragraphs.size(); i++) {
-        DOCX::Paragraph cur_p = paragraphs.at(i);
-        body.add_child(paragraphs.at(i).get());
+    if (dedupe_paragraphs) {
+        dedupe_last(index == SIZE_MAX ? records.size() - 1 : index);
     }
+}
 
-    // Add global document properties
+// If the paragraph just packed has the same contents as an earlier one, its text and runs are
+// dropped again and it shares those of the earlier one. Otherwise it is indexed as index.
+inline void DOCX::dedupe_last(uint32_t index) {
+    ParagraphRecord& record = records.back();
+    size_t h = paragraph_hash(record);
+    auto range = paragraph_ids_by_hash.equal_range(h);
+    for (auto it = range.first; it != range.second; it++) {
+        // Different contents can have the same hash, so the contents are always compared
+        const ParagraphRecord& other = records[it->second];
+        if (it->second != index && same_contents(other, record)) {
+            text.resize(record.typeface_offset); // the paragraph's text starts with its typeface
+            runs.resize(record.first_run);
+            record = other;
+            if (record.same_as == 0) {
+                record.same_as = it->second + 1;
+            }
+            if (has_storage(record)) {
+                shared_storage.emplace(storage_key(record), 1).first->second++;
+            }
+            return;
+        }
+    }
+    paragraph_ids_by_hash.emplace(h, index);
+}
 
-    XML::Node sectPr("w:sectPr");
-    {
-        XML::Node pgMar("w:pgMar");
-        pgMar.self_closing = true;
-        pgMar.attributes["w:top"] = "720";
-        pgMar.attributes["w:right"] = "720";
-        pgMar.attributes["w:bottom"] = "720";
-        pgMar.attributes["w:left"] = "720";
-        pgMar.attributes["w:header"] = "360";
-        pgMar.attributes["w:footer"] = "360";
-        pgMar.attributes["w:gutter"] = "0";
-        sectPr.add_child(pgMar);
+// Called before the paragraph is replaced, while its text and runs are still there to be hashed
+inline void DOCX::unindex_paragraph(uint32_t index) {
+    auto range = paragraph_ids_by_hash.equal_range(paragraph_hash(records[index]));
+    for (auto it = range.first; it != range.second; it++) {
+        if (it->second == index) {
+            paragraph_ids_by_hash.erase(it);
+            return;
+        }
     }
-    body.add_child(sectPr);
+}
 
-    root.add_child(body);
-    return root;
+// The typeface and the texts of the runs of a paragraph follow each other in text
+inline size_t DOCX::paragraph_hash(const ParagraphRecord& record) const {
+    size_t text_size = record.typeface_size;
+    size_t h = std::hash<size_t>()(record.align * 31 + record.default_font_size);
+    for (size_t i = record.first_run; i < record.first_run + record.run_count; i++) {
+        h = h * 31 + runs[i].format * 2 + runs[i].preserve_space;
+        h = h * 31 + runs[i].text_size;
+        text_size += runs[i].text_size;
+    }
+    return h ^ std::hash<std::string_view>()(std::string_view(text).substr(record.typeface_offset, text_size));
 }
 
-inline size_t DOCX::global_font_size = 12;
+inline bool DOCX::same_contents(const ParagraphRecord& a, const ParagraphRecord& b) const {
+    if (a.align != b.align || a.default_font_size != b.default_font_size || a.typeface_size != b.typeface_size || a.run_count != b.run_count) {
+        return false;
+    }
+    size_t text_size = a.typeface_size;
+    for (size_t i = 0; i < a.run_count; i++) {
+        const RunRecord& run_a = runs[a.first_run + i];
+        const RunRecord& run_b = runs[b.first_run + i];
+        if (run_a.format != run_b.format || run_a.preserve_space != run_b.preserve_space || run_a.text_size != run_b.text_size) {
+            return false;
+        }
+        text_size += run_a.text_size;
+    }
+    return text.compare(a.typeface_offset, text_size, text, b.typeface_offset, text_size) == 0;
+}
 
-inline XML::Node DOCX::root_node() {
-    XML::Node root("w:document");
-    root.attributes["xmlns:o"] = "urn:schemas-microsoft-com:office:office";
-    root.attributes["xmlns:r"] = "http://schemas.openxmlformats.org/officeDocument/2006/relationships";
-    root.attributes["xmlns:v"] = "urn:schemas-microsoft-com:vml";
-    root.attributes["xmlns:w"] = "http://schemas.openxmlformats.org/wordprocessingml/2006/main";
-    root.attributes["xmlns:w10"] = "urn:schemas-microsoft-com:office:word";
-    root.attributes["xmlns:wp"] = "http://schemas.openxmlformats.org/drawingml/2006/wordprocessingDrawing";
-    root.attributes["xmlns:pic"] = "http://schemas.openxmlformats.org/drawingml/2006/picture";
-    root.attributes["xmlns:wps"] = "http://schemas.microsoft.com/office/word/2010/wordprocessingShape";
-    root.attributes["xmlns:wpg"] = "http://schemas.microsoft.com/office/word/2010/wordprocessingGroup";
-    root.attributes["xmlns:mc"] = "http://schemas.openxmlformats.org/markup-compatibility/2006";
-    root.attributes["xmlns:wp14"] = "http://schemas.microsoft.com/office/word/2010/wordprocessingDrawing";
-    root.attributes["xmlns:w14"] = "http://schemas.microsoft.com/office/word/2010/wordml";
-    root.attributes["xmlns:w15"] = "http://schemas.microsoft.com/office/word/2012/wordml";
-    root.attributes["mc:Ignorable"] = "w14 wp14 w15";
-    return root;
+// Paragraphs that point to the same text and runs are written the same
+inline bool DOCX::same_storage(const ParagraphRecord& a, const ParagraphRecord& b) {
+    return a.typeface_offset == b.typeface_offset && a.typeface_size == b.typeface_size
+        && a.first_run == b.first_run && a.run_count == b.run_count
+        && a.default_font_size == b.default_font_size && a.align == b.align;
 }
 
-///////////////////////////
-// Paragraph definitions //
-///////////////////////////
+// The pending paragraph is packed again if it was changed through the reference after it was packed
+// Records with text or runs of their own don't start at the same place, except for duplicates
+inline std::pair<uint64_t, uint32_t> DOCX::storage_key(const ParagraphRecord& record) {
+    return std::make_pair(record.typeface_offset, record.first_run);
+}
 
-inline void DOCX::Paragraph::add_text(Text t) {
-    contents.push_back(t);
+inline bool DOCX::has_storage(const ParagraphRecord& record) {
+    return record.typeface_size > 0 || record.run_count > 0;
 }
 
-inline void DOCX::Paragraph::add_text(std::string text_str) {
-    Text t(text_str);
-    contents.push_back(t);
+inline void DOCX::pack_pending() {
+    if (pending.empty()) {
+        return;
+    }
+    if (packed_pending.empty()) {
+        pack(pending.back());
+        packed_pending.push_back(pending.back());
+    } else if (!same_paragraph(pending.back(), packed_pending.back())) {
+        replace_paragraph(records.size() - 1, pending.back());
+        packed_pending.back() = pending.back();
+    }
 }
 
-inline void DOCX::Paragraph::add_formatted_text(Text t) { // same as add_text(Text)
-    contents.push_back(t);
+inline void DOCX::finish_pending() {
+    if (pending.empty()) {
+        return;
+    }
+    if (packed_pending.empty()) {
+        pack(pending.back());
+    } else if (!same_paragraph(pending.back(), packed_pending.back())) {
+        replace_paragraph(records.size() - 1, pending.back());
+    }
+    pending.clear();
+    packed_pending.clear();
 }
 
-inline void DOCX::Paragraph::add_plain_text(std::string text_str) { // same as add_text(std::string)
-    Text t(text_str);
-    contents.push_back(t);
+inline bool DOCX::same_paragraph(const DOCX::Paragraph& a, const DOCX::Paragraph& b) {
+    if (a.default_font_size != b.default_font_size || a.align != b.align || a.typeface != b.typeface || a.contents.size() != b.contents.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.contents.size(); i++) {
+        const DOCX::Text& t = a.contents[i];
+        if (t.text != b.contents[i].text || t.preserve_space != b.contents[i].preserve_space || !t.same_format(b.contents[i])) {
+            return false;
+        }
+    }
+    return true;
 }
 
-inline void DOCX::Paragraph::add_space(size_t count, size_t font_size) {
-    std::string spaces;
-    for (size_t i = 0; i < count; i++) {
-        spaces += " ";
+// Copies the text and runs of the paragraphs into new buffers in paragraph order, leaving out
+// those of replaced paragraphs. Runs shared by duplicate paragraphs are copied once.
+inline void DOCX::compact() {
+    std::pmr::string new_text(text.get_allocator());
+    std::pmr::vector<RunRecord> new_runs(runs.get_allocator());
+    new_text.reserve(text.size() - replaced_text_size);
+    new_runs.reserve(runs.size() - replaced_run_count);
+    std::unordered_map<uint32_t, std::pair<uint64_t, uint32_t>> moved; // old first run to new typeface offset and first run
+    std::pmr::map<std::pair<uint64_t, uint32_t>, uint32_t> new_shared_storage(shared_storage.get_allocator());
+
+    for (size_t i = 0; i < records.size(); i++) {
+        ParagraphRecord& record = records[i];
+        if (!shared_storage.empty() && record.run_count > 0) {
+            auto it = moved.find(record.first_run);
+            if (it != moved.end()) {
+                record.typeface_offset = it->second.first;
+                record.first_run = it->second.second;
+                new_shared_storage.emplace(storage_key(record), 1).first->second++;
+                continue;
+            }
+            moved.emplace(record.first_run, std::make_pair(uint64_t(new_text.size()), uint32_t(new_runs.size())));
+        }
+        uint64_t typeface_offset = new_text.size();
+        new_text.append(text, record.typeface_offset, record.typeface_size);
+        record.typeface_offset = typeface_offset;
+
+        uint32_t first_run = new_runs.size();
+        for (size_t r = record.first_run; r < record.first_run + record.run_count; r++) {
+            RunRecord& run = new_runs.emplace_back(runs[r]);
+            run.text_offset = new_text.size();
+            new_text.append(text, runs[r].text_offset, runs[r].text_size);
+        }
+        record.first_run = first_run;
     }
 
-    Text t(spaces);
-    t.preserve_space = true;
-    if (font_size > 0) {
-        t.size = font_size;
+    text.swap(new_text);
+    runs.swap(new_runs);
+    shared_storage.swap(new_shared_storage);
+    replaced_text_size = replaced_run_count = 0;
+}
+
+inline uint32_t DOCX::intern_format(const DOCX::Text& t) {
+    size_t h = t.format_hash();
+    auto range = format_ids_by_hash.equal_range(h);
+    for (auto it = range.first; it != range.second; it++) {
+        if (formats[it->second].same_format(t)) {
+            return it->second;
+        }
     }
-    contents.push_back(t);
+
+    uint32_t id = formats.size();
+    formats.emplace_back().copy_format(t);
+    format_ids_by_hash.emplace(h, id);
+    return id;
 }
 
-inline void DOCX::Paragraph::add_bold_text(std::string text_str) {
-    Text t(text_str);
-    t.bold = true;
-    contents.push_back(t);
+// Same markup as Paragraph::write(), runs refer to their styles in style_ids if it's given
+inline void DOCX::write_paragraph(size_t index, std::string& out, const Settings& write_settings, const size_t* style_ids) const {
+    const ParagraphRecord& record = records[index];
+    std::string_view all_text(text);
+
+    out += "<w:p>";
+    Paragraph::write_properties(out, write_settings, Paragraph::alignment(record.align), record.default_font_size,
+        all_text.substr(record.typeface_offset, record.typeface_size));
+
+    size_t end = record.first_run + record.run_count;
+    size_t next = 0;
+    for (size_t i = record.first_run; i < end; i = next) {
+        const RunRecord& run = runs[i];
+
+        // Formats are stored once, so runs with the same format have the same index
+        bool preserve_space = run.preserve_space;
+        next = i + 1;
+        if (write_settings.coalesce_runs) {
+            while (next < end && runs[next].format == run.format) {
+                preserve_space = preserve_space || runs[next].preserve_space;
+                next++;
+            }
+        }
+
+        size_t style_id = style_ids != nullptr ? style_ids[run.format] : FormatTable::NONE;
+        Paragraph::write_run_start(out, write_settings, formats[run.format], style_id, preserve_space);
+        // The texts of the runs of a paragraph follow each other in text
+        const RunRecord& last = runs[next - 1];
+        DOCXUtils::append_escaped(out, all_text.substr(run.text_offset, last.text_offset + last.text_size - run.text_offset));
+        out += "</w:t></w:r>";
+    }
+    out += "</w:p>";
 }
 
-inline void DOCX::Paragraph::add_italic_text(std::string text_str) {
-    Text t(text_str);
-    t.italic = true;
-    contents.push_back(t);
+// Duplicates of a paragraph earlier in the range are copied from its XML if they still share its storage
+inline void DOCX::write_paragraphs(size_t begin, size_t end, std::string& out, const Settings& write_settings, const size_t* style_ids) const {
+    if (!dedupe_paragraphs) {
+        for (size_t i = begin; i < end; i++) {
+            write_paragraph(i, out, write_settings, style_ids);
+        }
+        return;
+    }
+
+    std::vector<size_t> starts(end - begin + 1);
+    for (size_t i = begin; i < end; i++) {
+        starts[i - begin] = out.size();
+        const ParagraphRecord& record = records[i];
+        size_t original = record.same_as - 1;
+        if (record.same_as != 0 && original >= begin && original < i && same_storage(records[original], record)) {
+            size_t start = starts[original - begin];
+            size_t size = starts[original - begin + 1] - start;
+            out.reserve(out.size() + size);
+            out.append(out.data() + start, size);
+        } else {
+            write_paragraph(i, out, write_settings, style_ids);
+        }
+    }
 }
 
-inline void DOCX::Paragraph::add_underlined_text(std::string text_str) {
-    Text t(text_str);
-    t.underline = true;
-    contents.push_back(t);
+inline void DOCX::print() {
+    get().print();
 }
 
-inline void DOCX::Paragraph::add_struckthrough_text(std::string text_str) {
-    Text t(text_str);
-    t.strikethrough = true;
-    contents.push_back(t);
+// The package is written to a uniquely named temporary file next to fname which then replaces
+// fname, so concurrent saves never write into the same file and fname is never seen half written
+inline void DOCX::save(std::string fname) {
+    DOCXAllocations::Scope scope("DOCX::save");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::string temp_fname = DOCXUtils::temp_fname_for(fname);
+    std::ofstream ofs(temp_fname, std::ios::binary);
+    if (!ofs) {
+        std::cerr << "Could not open file for writing: " << temp_fname << newl;
+        return;
+    }
+
+    SaveStats stats;
+    SaveStats* stats_ptr = save_stats_callback ? &stats : nullptr;
+    save_package([&ofs](const char* data, size_t len) {
+        ofs.write(data, len);
+    }, stats_ptr);
+
+    std::chrono::steady_clock::time_point replace_start = std::chrono::steady_clock::now();
+    ofs.close();
+    DOCXUtils::replace_file(temp_fname, fname, !ofs.fail());
+    if (stats_ptr != nullptr) {
+        stats.phases.push_back({"replace_file", DOCXUtils::seconds_since(replace_start), 0, 0});
+        stats.seconds = DOCXUtils::seconds_since(start);
+        add_allocation_counts(stats, scope);
+        save_stats_callback(stats);
+    }
 }
 
-inline XML::Node DOCX::Paragraph::get() {
-    XML::Node p("w:p");
-    {
-        XML::Node pPr("w:pPr");
-        {
-            XML::Node pStyle("w:pStyle");
+inline void DOCX::save(std::ostream& os) {
+    save([&os](const char* data, size_t len) {
+        os.write(data, len);
+    });
+}
+
+// Every byte of the package is passed to sink in order, so it can go straight to a socket etc.
+inline void DOCX::save(std::function<void(const char* data, size_t len)> sink) {
+    DOCXAllocations::Scope scope("DOCX::save");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    SaveStats stats;
+    SaveStats* stats_ptr = save_stats_callback ? &stats : nullptr;
+    save_package(sink, stats_ptr);
+    if (stats_ptr != nullptr) {
+        stats.seconds = DOCXUtils::seconds_since(start);
+        add_allocation_counts(stats, scope);
+        save_stats_callback(stats);
+    }
+}
+
+// Appends the package to buffer
+inline void DOCX::save_to_buffer(std::vector<char>& buffer) {
+    save([&buffer](const char* data, size_t len) {
+        buffer.insert(buffer.end(), data, data + len);
+    });
+}
+
+// Appends the package to buffer
+inline void DOCX::save_to_buffer(std::string& buffer) {
+    save([&buffer](const char* data, size_t len) {
+        buffer.append(data, len);
+    });
+}
+
+inline bool DOCX::load(std::string fname) {
+    DOCXZipReader zip;
+    if (!zip.open(fname)) {
+        return false;
+    }
+    return load_package(zip);
+}
+
+inline bool DOCX::load_from_buffer(std::string_view buffer) {
+    DOCXZipReader zip;
+    if (!zip.open(buffer)) {
+        return false;
+    }
+    return load_package(zip);
+}
+
+inline bool DOCX::append_to(std::string fname) {
+    DOCXAllocations::Scope scope("DOCX::append_to");
+    pack_pending();
+    DOCXZipReader zip;
+    if (!zip.open(fname)) {
+        return false;
+    }
+    const DOCXZipReader::Entry* document_entry = zip.find("word/document.xml");
+    if (document_entry == nullptr) {
+        std::cerr << "No word/document.xml in the package" << newl;
+        return false;
+    }
+
+    // Nothing can be left to styles.xml, it isn't the one these settings describe
+    Settings body_settings = settings;
+    body_settings.intern_run_formats = false;
+    body_settings.compact_markup = false;
+    body_settings.explicit_run_defaults = true;
+    std::string body;
+    write_paragraphs(0, records.size(), body, body_settings, nullptr);
+
+    AppendedDocument document;
+    if (!append_to_document(zip, *document_entry, body, worker_count(), document)) {
+        return false;
+    }
+
+    std::string temp_fname = DOCXUtils::temp_fname_for(fname);
+    std::ofstream ofs(temp_fname, std::ios::binary);
+    if (!ofs) {
+        std::cerr << "Could not open file for writing: " << temp_fname << newl;
+        return false;
+    }
+    DOCXZip out([&ofs](const char* data, size_t len) {
+        ofs.write(data, len);
+    });
+
+    const std::vector<DOCXZipReader::Entry>& entries = zip.get_entries();
+    std::string xml;
+    for (size_t i = 0; i < entries.size(); i++) {
+        const DOCXZipReader::Entry& entry = entries[i];
+        if (&entry == document_entry) {
+            out.add_raw_file(entry.name, document.method, document.crc, document.size, { document.prefix, document.tail }, entry.flags);
+            continue;
+        }
+        if (entry.name == "docProps/app.xml" && zip.read(entry, xml)) {
+            update_app_properties(xml);
+            out.add_file(entry.name, xml);
+            continue;
+        }
+
+        std::string_view data = zip.compressed_data(entry);
+        if (data.size() != entry.compressed_size || (entry.flags & 1) != 0) { // encrypted entries can't be copied like this
+            std::cerr << "Could not copy zip entry: " << entry.name << newl;
+            ofs.close();
+            std::error_code ec;
+            std::filesystem::remove(temp_fname, ec);
+            return false;
+        }
+        out.add_raw_file(entry.name, entry.method, entry.crc, entry.size, { data }, entry.flags);
+    }
+    out.finish();
+    ofs.close();
+    zip.close(); // fname may not be replaced while it's open on some systems
+    return DOCXUtils::replace_file(temp_fname, fname, !ofs.fail());
+}
+
+// Deflated documents are spliced, others are read and compressed again as a whole
+inline bool DOCX::append_to_document(const DOCXZipReader& zip, const DOCXZipReader::Entry& entry, std::string_view body, size_t workers, AppendedDocument& out) {
+    std::string_view compressed = zip.compressed_data(entry);
+    if (entry.method == 8 && compressed.size() == entry.compressed_size && splice_document(compressed, entry, body, out)) {
+        return true;
+    }
+
+    std::string xml;
+    if (!zip.read(entry, xml)) {
+        return false;
+    }
+    size_t position = body_insert_position(xml);
+    if (position == std::string::npos) {
+        std::cerr << "No w:body in word/document.xml" << newl;
+        return false;
+    }
+    xml.insert(position, body);
+
+    DOCXZip::Compressed document = DOCXZip::compress_parallel(xml, workers);
+    out.method = document.method;
+    out.crc = document.crc;
+    out.size = document.size;
+    out.prefix = std::string_view();
+    out.tail = std::move(document.data);
+    return true;
+}
+
+// The whole document is inflated a block at a time, keeping only the XML of the last two blocks
+// and the window before them. If the place to insert at is in those, the compressed blocks before
+// it are kept as they are and the rest is deflated again, continuing the old stream at the bit
+// where the block started. False if that isn't possible.
+inline bool DOCX::splice_document(std::string_view compressed, const DOCXZipReader::Entry& entry, std::string_view body, AppendedDocument& out) {
+    struct Boundary {
+        size_t bit = 0; // in compressed
+        size_t offset = 0; // in the XML
+        uLong crc = 0; // of the XML before offset
+    };
+
+    z_stream strm = {};
+    strm.zalloc = DOCXAllocations::zlib_alloc;
+    strm.zfree = DOCXAllocations::zlib_free;
+    if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+        return false;
+    }
+    size_t consumed = 0; // avail_in and avail_out are only 32 bits wide, the data is passed on in pieces
+
+    uLong crc = crc32(0L, Z_NULL, 0);
+    Boundary last;
+    last.crc = crc;
+    Boundary previous = last;
+    std::string kept; // the XML from kept_start on
+    size_t kept_start = 0;
+    std::vector<char> chunk(DOCXZipReader::READ_CHUNK_SIZE);
+    int result = Z_OK;
+    while (result == Z_OK) {
+        if (strm.avail_in == 0 && consumed < compressed.size()) {
+            size_t piece = std::min<size_t>(compressed.size() - consumed, UINT_MAX);
+            strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data() + consumed));
+            strm.avail_in = piece;
+            consumed += piece;
+        }
+        strm.next_out = reinterpret_cast<Bytef*>(chunk.data());
+        strm.avail_out = chunk.size();
+        // Returns at every block boundary, after all of the block has been output
+        result = inflate(&strm, Z_BLOCK);
+        size_t produced = chunk.size() - strm.avail_out;
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(chunk.data()), produced);
+        kept.append(chunk.data(), produced);
+
+        if (result == Z_OK && (strm.data_type & 128) != 0) {
+            // data_type holds the number of bits of the last byte read that aren't used yet
+            Boundary boundary;
+            boundary.bit = strm.total_in * 8 - (strm.data_type & 63);
+            boundary.offset = strm.total_out;
+            boundary.crc = crc;
+            if (boundary.offset != last.offset) { // empty blocks, like the ones of sync flushes, don't count
+                previous = last;
+                last = boundary;
+            }
+
+            // Erasing in big steps keeps the moving down of what's left rare
+            size_t keep_from = previous.offset - std::min(previous.offset, DOCXZip::WINDOW_SIZE);
+            if (keep_from > kept_start && keep_from - kept_start > kept.size() / 2) {
+                kept.erase(0, keep_from - kept_start);
+                kept_start = keep_from;
+            }
+        }
+    }
+    size_t size = strm.total_out;
+    inflateEnd(&strm);
+    if (result != Z_STREAM_END || size != entry.size || crc != entry.crc) {
+        return false;
+    }
+
+    size_t position = body_insert_position(kept);
+    if (position == std::string::npos) {
+        return false;
+    }
+    position += kept_start;
+    const Boundary* from = last.offset <= position ? &last : previous.offset <= position ? &previous : nullptr;
+    if (from == nullptr || from->offset < kept_start + std::min(from->offset, DOCXZip::WINDOW_SIZE)) {
+        return false;
+    }
+
+    z_stream def = {};
+    def.zalloc = DOCXAllocations::zlib_alloc;
+    def.zfree = DOCXAllocations::zlib_free;
+    if (deflateInit2(&def, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    size_t dictionary_size = std::min(from->offset, DOCXZip::WINDOW_SIZE);
+    deflateSetDictionary(&def, reinterpret_cast<const Bytef*>(kept.data() + from->offset - kept_start - dictionary_size), dictionary_size);
+    int bits = from->bit % 8;
+    if (bits > 0) {
+        // The block starts inside a byte, the bits before it are passed on so the new data follows them
+        deflatePrime(&def, bits, static_cast<unsigned char>(compressed[from->bit / 8]) & ((1 << bits) - 1));
+    }
+
+    std::string_view xml(kept);
+    std::string_view pieces[3] = {
+        xml.substr(from->offset - kept_start, position - from->offset),
+        body,
+        xml.substr(position - kept_start)
+    };
+    out.crc = from->crc;
+    out.size = from->offset;
+    out.tail.clear();
+    size_t produced = 0;
+    for (size_t i = 0; i < 3; i++) {
+        out.crc = crc32_z(out.crc, reinterpret_cast<const Bytef*>(pieces[i].data()), pieces[i].size());
+        out.size += pieces[i].size();
+
+        size_t piece_consumed = 0;
+        int ret = Z_OK;
+        do {
+            if (def.avail_in == 0 && piece_consumed < pieces[i].size()) {
+                size_t piece = std::min<size_t>(pieces[i].size() - piece_consumed, UINT_MAX);
+                def.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(pieces[i].data() + piece_consumed));
+                def.avail_in = piece;
+                piece_consumed += piece;
+            }
+            int flush = i == 2 && piece_consumed == pieces[i].size() ? Z_FINISH : Z_NO_FLUSH;
+            if (out.tail.size() - produced < (1 << 16)) {
+                out.tail.resize(out.tail.size() * 2 + (1 << 16));
+            }
+            def.next_out = reinterpret_cast<Bytef*>(&out.tail[produced]);
+            def.avail_out = std::min<size_t>(out.tail.size() - produced, UINT_MAX);
+            ret = deflate(&def, flush);
+            produced = reinterpret_cast<char*>(def.next_out) - out.tail.data();
+            if (flush == Z_FINISH && ret == Z_STREAM_END) {
+                break;
+            }
+        } while (ret != Z_STREAM_ERROR && (def.avail_in > 0 || piece_consumed < pieces[i].size() || i == 2));
+    }
+    out.tail.resize(produced);
+    deflateEnd(&def);
+
+    out.method = 8;
+    out.prefix = compressed.substr(0, from->bit / 8);
+    return true;
+}
+
+// Before the body's own w:sectPr, which comes after its last paragraph or table, otherwise right
+// before </w:body>. The w:sectPr in the properties of paragraphs are before their </w:p>.
+inline size_t DOCX::body_insert_position(std::string_view xml) {
+    size_t body_end = xml.rfind("</w:body>");
+    if (body_end == std::string_view::npos) {
+        return std::string_view::npos;
+    }
+
+    size_t content_end = 0;
+    for (std::string_view tag : { "</w:p>", "</w:tbl>", "</w:sdt>" }) {
+        size_t pos = xml.rfind(tag, body_end);
+        if (pos != std::string_view::npos) {
+            content_end = std::max(content_end, pos + tag.size());
+        }
+    }
+
+    std::string_view sect_pr = "<w:sectPr";
+    for (size_t pos = xml.find(sect_pr, content_end); pos < body_end; pos = xml.find(sect_pr, pos + 1)) {
+        char c = xml[pos + sect_pr.size()];
+        if (c == '>' || c == '/' || c == ' ' || c == '\t' || c == '\r' || c == '\n') { // not w:sectPrChange
+            return pos;
+        }
+    }
+    return body_end;
+}
+
+// Adds the paragraphs, words and characters of this document to the statistics of the other one
+inline void DOCX::update_app_properties(std::string& xml) const {
+    size_t words = 0;
+    size_t characters = 0;
+    size_t characters_with_spaces = 0;
+    for (size_t p = 0; p < records.size(); p++) {
+        const ParagraphRecord& record = records[p];
+        bool in_word = false;
+        for (size_t r = record.first_run; r < record.first_run + record.run_count; r++) {
+            std::string_view run_text = std::string_view(text).substr(runs[r].text_offset, runs[r].text_size);
+            for (size_t i = 0; i < run_text.size(); i++) {
+                char c = run_text[i];
+                if ((c & 0xC0) == 0x80) { // continuation byte of a UTF-8 sequence
+                    continue;
+                }
+                characters_with_spaces++;
+                if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+                    in_word = false;
+                } else {
+                    characters++;
+                    words += in_word ? 0 : 1;
+                    in_word = true;
+                }
+            }
+        }
+    }
+
+    add_to_count(xml, "Paragraphs", records.size());
+    add_to_count(xml, "Words", words);
+    add_to_count(xml, "Characters", characters);
+    add_to_count(xml, "CharactersWithSpaces", characters_with_spaces);
+}
+
+inline void DOCX::add_to_count(std::string& xml, std::string_view tag, size_t count) {
+    std::string start_tag = "<" + std::string(tag) + ">";
+    size_t start = xml.find(start_tag);
+    if (start == std::string::npos) {
+        return;
+    }
+    start += start_tag.size();
+    size_t end = xml.find('<', start);
+    if (end == std::string::npos) {
+        return;
+    }
+    std::string val;
+    DOCXUtils::append_uint(val, DOCXUtils::parse_uint(std::string_view(xml).substr(start, end - start)) + count);
+    xml.replace(start, end - start, val);
+}
+
+// Only word/styles.xml and word/document.xml are read, the document is pull parsed straight into
+// the packed records without building XML::Nodes or Paragraphs
+inline bool DOCX::load_package(const DOCXZipReader& zip) {
+    const DOCXZipReader::Entry* document_entry = zip.find("word/document.xml");
+    if (document_entry == nullptr) {
+        std::cerr << "No word/document.xml in the package" << newl;
+        return false;
+    }
+
+    clear();
+    Settings defaults;
+    settings.font_size = defaults.font_size;
+    settings.latin_typeface = defaults.latin_typeface;
+    settings.ea_typeface = defaults.ea_typeface;
+    settings.cs_typeface = defaults.cs_typeface;
+
+    std::string xml;
+    CharacterStyles styles;
+    const DOCXZipReader::Entry* styles_entry = zip.find("word/styles.xml");
+    if (styles_entry != nullptr && zip.read(*styles_entry, xml)) {
+        read_styles(xml, styles);
+    }
+
+    if (!zip.read(*document_entry, xml)) {
+        return false;
+    }
+    read_document(xml, styles);
+    return true;
+}
+
+// Reads the default run properties into settings and the character styles into styles
+inline void DOCX::read_styles(std::string_view xml, CharacterStyles& styles) {
+    DOCXXmlReader reader(xml);
+    bool in_defaults = false;
+    bool in_run_properties = false;
+    DOCX::Text* style = nullptr;
+    CharacterStyles no_styles;
+    size_t change_depth = 0;
+
+    while (reader.next()) {
+        std::string_view name = reader.name();
+        if (in_property_change(reader, change_depth)) {
+            continue;
+        }
+        if (name == "w:docDefaults") {
+            in_defaults = !reader.is_end();
+        } else if (name == "w:style") {
+            style = nullptr;
+            if (!reader.is_end() && reader.attribute("w:type") == "character") {
+                std::string id;
+                DOCXXmlReader::append_unescaped(id, reader.attribute("w:styleId"));
+                style = &styles[id];
+                style->size = settings.font_size; // docDefaults comes before the styles
+            }
+        } else if (name == "w:rPr") {
+            in_run_properties = !reader.is_end();
+        } else if (in_run_properties && in_defaults && reader.is_start()) {
+            if (name == "w:sz") {
+                settings.font_size = DOCXUtils::parse_uint(reader.attribute("w:val")) / 2; // because half points
+            } else if (name == "w:rFonts") {
+                settings.latin_typeface.clear();
+                settings.ea_typeface.clear();
+                settings.cs_typeface.clear();
+                DOCXXmlReader::append_unescaped(settings.latin_typeface, reader.attribute("w:ascii"));
+                DOCXXmlReader::append_unescaped(settings.ea_typeface, reader.attribute("w:eastAsia"));
+                DOCXXmlReader::append_unescaped(settings.cs_typeface, reader.attribute("w:cs"));
+            }
+        } else if (in_run_properties && style != nullptr) {
+            read_run_property(reader, *style, no_styles);
+        }
+    }
+}
+
+// Only the outermost paragraphs are read, the ones in text boxes etc. inside them are skipped.
+// Paragraphs in tables are read as if they were in the body.
+inline void DOCX::read_document(std::string_view xml, const CharacterStyles& styles) {
+    DOCXXmlReader reader(xml);
+    size_t depth = 0; // of w:p elements
+    bool in_paragraph_properties = false;
+    bool in_paragraph_run_properties = false;
+    bool in_run = false;
+    bool in_run_properties = false;
+    bool in_text = false;
+
+    DOCX::Text default_format;
+    default_format.size = settings.font_size;
+    DOCX::Text format; // of the current run
+    uint32_t last_format = UINT32_MAX; // neighboring runs mostly have the same format, which saves a lookup
+    uint64_t run_text_offset = 0;
+    bool preserve_space = false;
+    size_t change_depth = 0; // of tracked property changes
+
+    while (reader.next()) {
+        std::string_view name = reader.name();
+        if (in_text && depth == 1) {
+            DOCXXmlReader::append_unescaped(text, reader.text());
+            if (name.empty()) {
+                text.append(reader.cdata());
+            }
+        }
+
+        if (name == "w:p") {
+            if (reader.is_start()) {
+                depth++;
+                if (depth == 1) {
+                    ParagraphRecord& record = records.emplace_back();
+                    record.typeface_offset = text.size();
+                    record.first_run = runs.size();
+                    record.align = Paragraph::AUTO;
+                }
+            }
+            if (reader.is_end() && depth > 0) {
+                depth--;
+                if (depth == 0) {
+                    in_paragraph_properties = in_paragraph_run_properties = in_run = in_run_properties = in_text = false;
+                    change_depth = 0;
+                }
+            }
+            continue;
+        }
+        if (depth != 1 || in_property_change(reader, change_depth)) {
+            continue;
+        }
+
+        if (name == "w:pPr") {
+            in_paragraph_properties = !reader.is_end();
+        } else if (name == "w:r") {
+            if (reader.is_start() && !reader.is_end()) {
+                in_run = true;
+                format.copy_format(default_format);
+                run_text_offset = text.size();
+                preserve_space = false;
+            } else if (reader.is_end() && in_run) {
+                in_run = in_run_properties = in_text = false;
+                if (text.size() > run_text_offset) { // runs without text, like breaks or drawings, are dropped
+                    RunRecord& run = runs.emplace_back();
+                    run.text_offset = run_text_offset;
+                    run.text_size = text.size() - run_text_offset;
+                    if (last_format == UINT32_MAX || !formats[last_format].same_format(format)) {
+                        last_format = intern_format(format);
+                    }
+                    run.format = last_format;
+                    run.preserve_space = preserve_space;
+                    records.back().run_count++;
+                }
+            }
+        } else if (name == "w:rPr") {
+            in_run_properties = in_run && !reader.is_end();
+            in_paragraph_run_properties = in_paragraph_properties && !reader.is_end();
+        } else if (in_run_properties) {
+            read_run_property(reader, format, styles);
+        } else if (in_paragraph_run_properties && reader.is_start()) {
+            ParagraphRecord& record = records.back();
+            if (name == "w:sz") {
+                record.default_font_size = DOCXUtils::parse_uint(reader.attribute("w:val")) / 2; // because half points
+            } else if (name == "w:rFonts" && record.run_count == 0 && text.size() == record.typeface_offset) {
+                DOCXXmlReader::append_unescaped(text, reader.attribute("w:ascii"));
+                record.typeface_size = text.size() - record.typeface_offset;
+            }
+        } else if (in_paragraph_properties && name == "w:jc" && reader.is_start()) {
+            std::string_view val = reader.attribute("w:val");
+            ParagraphRecord& record = records.back();
+            record.align = val == "left" ? Paragraph::LEFT
+                : val == "center" ? Paragraph::CENTER
+                : val == "right" || val == "end" ? Paragraph::RIGHT
+                : val == "both" ? Paragraph::JUSTIFIED
+                : val == "distribute" ? Paragraph::FULL_WIDTH
+                : Paragraph::AUTO;
+        } else if (in_run && name == "w:t") {
+            in_text = !reader.is_end();
+            if (in_text && reader.attribute("xml:space") == "preserve") {
+                preserve_space = true;
+            }
+        } else if (in_run && name == "w:tab" && reader.is_start()) {
+            text += '\t';
+            preserve_space = true;
+        }
+    }
+}
+
+// Tracked changes keep the properties from before the change in a w:rPr or w:pPr of their own,
+// which must neither apply nor end the properties around them. True for the change elements and
+// everything in them.
+inline bool DOCX::in_property_change(const DOCXXmlReader& reader, size_t& change_depth) {
+    std::string_view name = reader.name();
+    if (name == "w:rPrChange" || name == "w:pPrChange") {
+        if (!reader.is_end()) {
+            change_depth++;
+        } else if (!reader.is_start() && change_depth > 0) {
+            change_depth--;
+        }
+        return true;
+    }
+    return change_depth > 0;
+}
+
+// Reads one child element of w:rPr into format
+inline void DOCX::read_run_property(const DOCXXmlReader& reader, DOCX::Text& format, const CharacterStyles& styles) {
+    if (!reader.is_start()) {
+        return;
+    }
+    std::string_view name = reader.name();
+    std::string_view val = reader.attribute("w:val");
+    // Toggle properties are on unless turned off explicitly
+    bool on = val != "0" && val != "false" && val != "off";
+
+    if (name == "w:rStyle") {
+        auto style = styles.find(val);
+        if (style != styles.end()) {
+            format.copy_format(style->second);
+        }
+    } else if (name == "w:b") {
+        format.bold = on;
+    } else if (name == "w:i") {
+        format.italic = on;
+    } else if (name == "w:u") {
+        format.underline = val != "none";
+    } else if (name == "w:strike" || name == "w:dstrike") {
+        format.strikethrough = on;
+    } else if (name == "w:sz") {
+        format.size = DOCXUtils::parse_uint(val) / 2; // because half points
+    } else if (name == "w:rFonts") {
+        std::string_view typeface = reader.attribute("w:ascii");
+        format.typeface.clear();
+        DOCXXmlReader::append_unescaped(format.typeface, typeface.empty() ? reader.attribute("w:hAnsi") : typeface);
+    } else if (name == "w:color") {
+        format.color.clear();
+        if (val != "auto") {
+            DOCXXmlReader::append_unescaped(format.color, val);
+        }
+    } else if (name == "w:highlight") {
+        format.highlight.clear();
+        if (val != "none") {
+            DOCXXmlReader::append_unescaped(format.highlight, val);
+        }
+    } else if (name == "w:shd") {
+        std::string_view fill = reader.attribute("w:fill");
+        format.bg_color.clear();
+        if (fill != "auto") {
+            DOCXXmlReader::append_unescaped(format.bg_color, fill);
+        }
+    }
+}
+
+inline void DOCX::set_global_font_size(size_t set_size) {
+    settings.font_size = set_size;
+}
+
+inline size_t DOCX::get_global_font_size() {
+    return settings.font_size;
+}
+
+inline void DOCX::set_dedupe_paragraphs(bool enabled) {
+    pack_pending();
+    dedupe_paragraphs = enabled;
+    if (!enabled) {
+        std::pmr::unordered_multimap<size_t, uint32_t>(paragraph_ids_by_hash.get_allocator()).swap(paragraph_ids_by_hash);
+    }
+}
+
+inline void DOCX::set_incremental_save(bool enabled) {
+    chunk_cache.enabled = enabled;
+    chunk_cache.chunks.clear();
+}
+
+inline void DOCX::set_thread_count(size_t count) {
+    thread_count = count;
+}
+
+inline size_t DOCX::get_thread_count() {
+    return thread_count;
+}
+
+inline void DOCX::set_save_stats_callback(std::function<void(const SaveStats& stats)> callback) {
+    save_stats_callback = callback;
+}
+
+inline XML::Node DOCX::get() {
+    DOCXAllocations::Scope scope("DOCX::get");
+    XML::Node root = root_node();
+    XML::Node body("w:body");
+
+    // Add paragraphs
+
+    pack_pending();
+    for (size_t i = 0; i < records.size(); i++) {
+        body.add_child(get_paragraph(i).get(settings));
+    }
+
+    // Add global document properties
+
+    XML::Node sectPr("w:sectPr");
+    {
+        XML::Node pgMar("w:pgMar");
+        pgMar.self_closing = true;
+        pgMar.attributes["w:top"] = "720";
+        pgMar.attributes["w:right"] = "720";
+        pgMar.attributes["w:bottom"] = "720";
+        pgMar.attributes["w:left"] = "720";
+        pgMar.attributes["w:header"] = "360";
+        pgMar.attributes["w:footer"] = "360";
+        pgMar.attributes["w:gutter"] = "0";
+        sectPr.add_child(pgMar);
+    }
+    body.add_child(sectPr);
+
+    root.add_child(body);
+    return root;
+}
+
+// Only reads the DOCXUtils defaults, so it should not race with code that changes them
+inline DOCX::Settings DOCX::default_settings() {
+    Settings defaults;
+    defaults.latin_typeface = DOCXUtils::latin_typeface;
+    defaults.ea_typeface = DOCXUtils::ea_typeface;
+    defaults.cs_typeface = DOCXUtils::cs_typeface;
+    return defaults;
+}
+
+inline XML::Node DOCX::root_node() {
+    XML::Node root("w:document");
+    root.attributes["xmlns:o"] = "urn:schemas-microsoft-com:office:office";
+    root.attributes["xmlns:r"] = "http://schemas.openxmlformats.org/officeDocument/2006/relationships";
+    root.attributes["xmlns:v"] = "urn:schemas-microsoft-com:vml";
+    root.attributes["xmlns:w"] = "http://schemas.openxmlformats.org/wordprocessingml/2006/main";
+    root.attributes["xmlns:w10"] = "urn:schemas-microsoft-com:office:word";
+    root.attributes["xmlns:wp"] = "http://schemas.openxmlformats.org/drawingml/2006/wordprocessingDrawing";
+    root.attributes["xmlns:pic"] = "http://schemas.openxmlformats.org/drawingml/2006/picture";
+    root.attributes["xmlns:wps"] = "http://schemas.microsoft.com/office/word/2010/wordprocessingShape";
+    root.attributes["xmlns:wpg"] = "http://schemas.microsoft.com/office/word/2010/wordprocessingGroup";
+    root.attributes["xmlns:mc"] = "http://schemas.openxmlformats.org/markup-compatibility/2006";
+    root.attributes["xmlns:wp14"] = "http://schemas.microsoft.com/office/word/2010/wordprocessingDrawing";
+    root.attributes["xmlns:w14"] = "http://schemas.microsoft.com/office/word/2010/wordml";
+    root.attributes["xmlns:w15"] = "http://schemas.microsoft.com/office/word/2012/wordml";
+    root.attributes["mc:Ignorable"] = "w14 wp14 w15";
+    return root;
+}
+
+// Everything in word/document.xml that comes before the first paragraph
+inline std::string DOCX::document_prolog() {
+    return "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n"
+        "<w:document"
+        " xmlns:o=\"urn:schemas-microsoft-com:office:office\""
+        " xmlns:r=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships\""
+        " xmlns:v=\"urn:schemas-microsoft-com:vml\""
+        " xmlns:w=\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\""
+        " xmlns:w10=\"urn:schemas-microsoft-com:office:word\""
+        " xmlns:wp=\"http://schemas.openxmlformats.org/drawingml/2006/wordprocessingDrawing\""
+        " xmlns:pic=\"http://schemas.openxmlformats.org/drawingml/2006/picture\""
+        " xmlns:wps=\"http://schemas.microsoft.com/office/word/2010/wordprocessingShape\""
+        " xmlns:wpg=\"http://schemas.microsoft.com/office/word/2010/wordprocessingGroup\""
+        " xmlns:mc=\"http://schemas.openxmlformats.org/markup-compatibility/2006\""
+        " xmlns:wp14=\"http://schemas.microsoft.com/office/word/2010/wordprocessingDrawing\""
+        " xmlns:w14=\"http://schemas.microsoft.com/office/word/2010/wordml\""
+        " xmlns:w15=\"http://schemas.microsoft.com/office/word/2012/wordml\""
+        " mc:Ignorable=\"w14 wp14 w15\">"
+        "<w:body>";
+}
+
+// Everything in word/document.xml that comes after the last paragraph, same as the end of get()
+inline std::string DOCX::document_epilog() {
+    return "<w:sectPr>"
+        "<w:pgMar w:top=\"720\" w:right=\"720\" w:bottom=\"720\" w:left=\"720\" w:header=\"360\" w:footer=\"360\" w:gutter=\"0\"/>"
+        "</w:sectPr>"
+        "</w:body>"
+        "</w:document>";
+}
+
+///////////////////////////
+// Paragraph definitions //
+///////////////////////////
+
+inline void DOCX::Paragraph::add_text(const Text& t) {
+    contents.push_back(t);
+}
+
+inline void DOCX::Paragraph::add_text(Text&& t) {
+    contents.push_back(std::move(t));
+}
+
+inline void DOCX::Paragraph::add_text(std::string_view text_str) {
+    contents.emplace_back(text_str);
+}
+
+template <typename... Args>
+DOCX::Text& DOCX::Paragraph::emplace_text(Args&&... args) {
+    return contents.emplace_back(std::forward<Args>(args)...);
+}
+
+inline void DOCX::Paragraph::add_formatted_text(const Text& t) { // same as add_text(Text)
+    contents.push_back(t);
+}
+
+inline void DOCX::Paragraph::add_formatted_text(Text&& t) { // same as add_text(Text)
+    contents.push_back(std::move(t));
+}
+
+inline void DOCX::Paragraph::add_plain_text(std::string_view text_str) { // same as add_text(std::string_view)
+    contents.emplace_back(text_str);
+}
+
+inline void DOCX::Paragraph::add_space(size_t count, size_t font_size) {
+    Text& t = contents.emplace_back();
+    t.text.assign(count, ' ');
+    t.preserve_space = true;
+    if (font_size > 0) {
+        t.size = font_size;
+    }
+}
+
+inline void DOCX::Paragraph::add_bold_text(std::string_view text_str) {
+    contents.emplace_back(text_str).bold = true;
+}
+
+inline void DOCX::Paragraph::add_italic_text(std::string_view text_str) {
+    contents.emplace_back(text_str).italic = true;
+}
+
+inline void DOCX::Paragraph::add_underlined_text(std::string_view text_str) {
+    contents.emplace_back(text_str).underline = true;
+}
+
+inline void DOCX::Paragraph::add_struckthrough_text(std::string_view text_str) {
+    contents.emplace_back(text_str).strikethrough = true;
+}
+
+// Spaces are kept: the merged run preserves space if any of its parts did
+inline void DOCX::Paragraph::coalesce() {
+    if (contents.empty()) {
+        return;
+    }
+
+    size_t last = 0;
+    for (size_t i = 1; i < contents.size(); i++) {
+        if (contents[i].same_format(contents[last])) {
+            contents[last].text += contents[i].text;
+            contents[last].preserve_space = contents[last].preserve_space || contents[i].preserve_space;
+        } else {
+            last++;
+            if (last != i) {
+                contents[last] = std::move(contents[i]);
+            }
+        }
+    }
+    contents.resize(last + 1);
+}
+
+inline XML::Node DOCX::Paragraph::get() {
+    return get(DOCX::default_settings());
+}
+
+inline XML::Node DOCX::Paragraph::get(const DOCX::Settings& settings) {
+    DOCXAllocations::Scope scope("Paragraph::get");
+    XML::Node p("w:p");
+    {
+        XML::Node pPr("w:pPr");
+        {
+            XML::Node pStyle("w:pStyle");
             pStyle.self_closing = true;
             pStyle.attributes["w:val"] = "Normal";
             XML::Node bidi("w:bidi");
@@ -362,13 +2199,13 @@ inline XML::Node DOCX::Paragraph::get() {
         p.add_child(pPr);
 
         for (size_t i = 0; i < contents.size(); i++) {
-            Text cur_text = contents.at(i);
+            const Text& cur_text = contents.at(i);
 
             XML::Node r("w:r");
             {
                 XML::Node rPr("w:rPr");
                 {
-                    if (cur_text.size != DOCX::global_font_size) {
+                    if (cur_text.size != settings.font_size || settings.explicit_run_defaults) {
                         XML::Node sz("w:sz");
                         sz.self_closing = true;
                         sz.attributes["w:val"] = std::to_string(cur_text.size * 2); // because half points
@@ -415,6 +2252,14 @@ inline XML::Node DOCX::Paragraph::get() {
                         rFonts.attributes["w:cs"] = cur_text.typeface;
                         rFonts.self_closing = true;
                         rPr.add_child(rFonts);
+                    } else if (settings.explicit_run_defaults) {
+                        XML::Node rFonts("w:rFonts");
+                        rFonts.attributes["w:ascii"] = settings.latin_typeface;
+                        rFonts.attributes["w:eastAsia"] = settings.ea_typeface;
+                        rFonts.attributes["w:hAnsi"] = settings.latin_typeface;
+                        rFonts.attributes["w:cs"] = settings.cs_typeface;
+                        rFonts.self_closing = true;
+                        rPr.add_child(rFonts);
                     }
 
                     if (cur_text.color != "") {
@@ -454,213 +2299,815 @@ inline XML::Node DOCX::Paragraph::get() {
     return p;
 }
 
-inline void DOCX::generate_docx_template() {
-    const char* PATH_DELIM = "/"; // for linux TODO make cross platform
+inline void DOCX::Paragraph::write(std::string& out, const DOCX::Settings& settings, const DOCX::FormatTable* formats) const {
+    out += "<w:p>";
+    write_properties(out, settings, align, default_font_size, typeface);
+
+    size_t next = 0;
+    for (size_t i = 0; i < contents.size(); i = next) {
+        const Text& cur_text = contents[i];
+
+        // Runs [i, next) are written as one, same as coalesce() would merge them
+        bool preserve_space = cur_text.preserve_space;
+        next = i + 1;
+        if (settings.coalesce_runs) {
+            while (next < contents.size() && contents[next].same_format(cur_text)) {
+                preserve_space = preserve_space || contents[next].preserve_space;
+                next++;
+            }
+        }
 
-    // Create root folder
-    std::string root_dirpath = "./docx_temp";
-    DOCXUtils::mkdir(root_dirpath);
+        size_t style_id = formats != nullptr ? formats->find(cur_text, settings) : FormatTable::NONE;
+        write_run_start(out, settings, cur_text, style_id, preserve_space);
+        for (size_t j = i; j < next; j++) {
+            DOCXUtils::append_escaped(out, contents[j].text);
+        }
+        out += "</w:t></w:r>";
+    }
+    out += "</w:p>";
+}
 
-    // Create directories in the root folder
-    DOCXUtils::mkdir(root_dirpath + PATH_DELIM + "_rels");
-    DOCXUtils::mkdir(root_dirpath + PATH_DELIM + "docProps");
-    DOCXUtils::mkdir(root_dirpath + PATH_DELIM + "word");
+inline void DOCX::Paragraph::write_properties(std::string& out, const DOCX::Settings& settings, alignment align, size_t default_font_size, std::string_view typeface) {
+    // In compact mode the Normal style, left to right and start alignment are left implicit,
+    // they are the defaults anyway
+    bool compact = settings.compact_markup;
+    bool has_run_properties = default_font_size > 0 || typeface != "";
 
-    // Create directories in the root/word folder
-    DOCXUtils::mkdir(root_dirpath + PATH_DELIM + "word" + PATH_DELIM + "_rels");
-    DOCXUtils::mkdir(root_dirpath + PATH_DELIM + "word" + PATH_DELIM + "theme");
+    if (compact && align == AUTO && !has_run_properties) {
+        return;
+    }
 
-    // Write root/[Content_Types].xml file
-    DOCXUtils::write_file(root_dirpath + PATH_DELIM + "[Content_Types].xml", DOCXUtils::content_types_file());
+    out += "<w:pPr>";
+    if (!compact) {
+        out += "<w:pStyle w:val=\"Normal\"/><w:bidi w:val=\"0\"/>";
+    }
+    if (!compact || align != AUTO) {
+        out += "<w:jc w:val=\"";
+        switch (align) {
+            case AUTO: out += "start"; break;
+            case LEFT: out += "left"; break;
+            case CENTER: out += "center"; break;
+            case RIGHT: out += "right"; break;
+            case JUSTIFIED: out += "both"; break;
+            case FULL_WIDTH: out += "distribute"; break;
+            default: {
+                std::cerr << "Invalid alignment: " << align << newl;
+                out += "start";
+                break;
+            }
+        }
+        out += "\"/>";
+    }
+    if (!compact || has_run_properties) {
+        out += "<w:rPr>";
+        if (default_font_size > 0) {
+            out += "<w:sz w:val=\"";
+            DOCXUtils::append_uint(out, default_font_size * 2); // because half points
+            out += "\"/><w:szCs w:val=\"";
+            DOCXUtils::append_uint(out, default_font_size * 2);
+            out += "\"/>";
+        }
+        if (typeface != "") {
+            out += "<w:rFonts w:ascii=\"";
+            DOCXUtils::append_escaped(out, typeface);
+            out += "\" w:eastAsia=\"";
+            DOCXUtils::append_escaped(out, typeface);
+            out += "\"/>";
+        }
+        out += "</w:rPr>";
+    }
+    out += "</w:pPr>";
+}
 
-    // Write root/_rels/.rels file
-    DOCXUtils::write_file(root_dirpath + PATH_DELIM + "_rels" + PATH_DELIM + ".rels", DOCXUtils::dotrels_file());
+inline void DOCX::Paragraph::write_run_start(std::string& out, const DOCX::Settings& settings, const DOCX::Text& format, size_t style_id, bool preserve_space) {
+    out += "<w:r>";
+    if (style_id != FormatTable::NONE) {
+        out += "<w:rPr><w:rStyle w:val=\"";
+        FormatTable::append_style_id(out, style_id);
+        out += "\"/></w:rPr>";
+    } else if (!settings.compact_markup || format.has_properties(settings)) {
+        out += "<w:rPr>";
+        format.write_properties(out, settings);
+        out += "</w:rPr>";
+    }
+    out += preserve_space ? "<w:t xml:space=\"preserve\">" : "<w:t>";
+}
 
-    // Write app.xml and core.xml in root/docProps
-    DOCXUtils::write_file(root_dirpath + PATH_DELIM + "docProps" + PATH_DELIM + "app.xml", DOCXUtils::app_file());
-    DOCXUtils::write_file(root_dirpath + PATH_DELIM + "docProps" + PATH_DELIM + "core.xml", DOCXUtils::core_file());
+// Same content as get(), but the bytes are appended to out directly without building XML::Nodes
+inline void DOCX::write_document(std::string& out, const size_t* style_ids) {
+    size_t workers = worker_count();
+
+    pack_pending();
+    out += document_prolog();
+    if (workers > 1 && records.size() >= PARALLEL_MIN_PARAGRAPHS) {
+        write_paragraphs_parallel(out, workers, style_ids);
+    } else {
+        out.reserve(out.size() + 1024 + text.size() + runs.size() * 64 + records.size() * 64);
+        write_paragraphs(0, records.size(), out, settings, style_ids);
+    }
+    out += document_epilog();
+}
 
-    // Write fontTable.xml, settings.xml, styles.xml files in root/word
-    DOCXUtils::write_file(root_dirpath + PATH_DELIM + "word" + PATH_DELIM + "fontTable.xml", DOCXUtils::font_table_file());
-    DOCXUtils::write_file(root_dirpath + PATH_DELIM + "word" + PATH_DELIM + "settings.xml", DOCXUtils::settings_file());
-    DOCXUtils::write_file(root_dirpath + PATH_DELIM + "word" + PATH_DELIM + "styles.xml", DOCXUtils::styles_file());
+// Paragraphs are split into consecutive chunks that are serialized into separate buffers by
+// the worker threads and then appended in order, so the output is the same as the sequential one
+inline void DOCX::write_paragraphs_parallel(std::string& out, size_t workers, const size_t* style_ids) {
+    // More chunks than workers so that a worker that gets short paragraphs doesn't sit idle
+    size_t chunk_size = (records.size() + workers * 4 - 1) / (workers * 4);
+    size_t chunk_count = (records.size() + chunk_size - 1) / chunk_size;
+    std::vector<std::string> chunks(chunk_count);
+    std::atomic<size_t> next_chunk(0);
+    DOCXAllocations::Scope* allocation_scope = DOCXAllocations::current_scope();
+
+    auto worker = [&]() {
+        DOCXAllocations::ThreadScope thread_scope(allocation_scope);
+        for (size_t c = next_chunk++; c < chunk_count; c = next_chunk++) {
+            size_t begin = c * chunk_size;
+            size_t end = std::min(begin + chunk_size, records.size());
+            chunks[c].reserve((end - begin) * 256);
+            write_paragraphs(begin, end, chunks[c], settings, style_ids);
+        }
+    };
 
-    // Write root/word/_rels/document.xml.rels
-    DOCXUtils::write_file(root_dirpath + PATH_DELIM + "word" + PATH_DELIM + "_rels" + PATH_DELIM + "document.xml.rels", DOCXUtils::document_xml_rels_file());
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < std::min(workers, chunk_count); i++) {
+        pool.emplace_back(worker);
+    }
+    worker(); // the calling thread works too
+    for (size_t i = 0; i < pool.size(); i++) {
+        pool[i].join();
+    }
 
-    // Write root/word/theme/theme1.xml
-    DOCXUtils::write_file(root_dirpath + PATH_DELIM + "word" + PATH_DELIM + "theme" + PATH_DELIM + "theme1.xml", DOCXUtils::theme1_file());
+    size_t total = 0;
+    for (size_t c = 0; c < chunk_count; c++) {
+        total += chunks[c].size();
+    }
+    out.reserve(out.size() + total + 1024);
+    for (size_t c = 0; c < chunk_count; c++) {
+        out += chunks[c];
+        std::string().swap(chunks[c]);
+    }
 }
 
-inline void DOCX::zip_docx_template(std::string fname) {
-    std::string save_cmd = "( cd docx_temp && zip -r ../" + fname + " . > /dev/null 2>&1 )";
-    system(save_cmd.c_str());
-}
+// Chunks with changed paragraphs and the paragraphs added since the last save are serialized and
+// compressed by the worker threads, the other chunks are reused as they are. Style ids don't
+// change as formats are only ever added, and the settings are compared.
+inline DOCXZip::Compressed DOCX::write_document_chunks(const size_t* style_ids) {
+    pack_pending();
+    ChunkCache& cache = chunk_cache;
+    if (!same_output(cache.settings, settings)) {
+        cache.chunks.clear();
+        cache.settings = settings;
+    }
+
+    std::vector<DocumentChunk> chunks;
+    chunks.reserve(cache.chunks.size() + 1);
+    size_t cached_count = 0;
+    for (size_t i = 0; i < cache.chunks.size(); i++) {
+        DocumentChunk& chunk = cache.chunks[i];
+        cached_count = chunk.first_paragraph + chunk.paragraph_count;
+        if (chunk.changed) {
+            split_chunk(chunks, chunk.first_paragraph, chunk.paragraph_count);
+        } else {
+            chunks.push_back(std::move(chunk));
+        }
+    }
+    split_chunk(chunks, cached_count, records.size() - cached_count);
+    cache.chunks.swap(chunks);
 
-inline void DOCX::delete_docx_template() {
-    std::vector<std::string> files = {
-        "docx_temp/_rels/.rels",
-        "docx_temp/_rels",
-        "docx_temp/docProps/app.xml",
-        "docx_temp/docProps/core.xml",
-        "docx_temp/docProps",
-        "docx_temp/word/document.xml",
-        "docx_temp/word/fontTable.xml",
-        "docx_temp/word/settings.xml",
-        "docx_temp/word/styles.xml",
-        "docx_temp/word/_rels/document.xml.rels",
-        "docx_temp/word/theme/theme1.xml",
-        "docx_temp/word/_rels",
-        "docx_temp/word/theme",
-        "docx_temp/word",
-        "docx_temp/[Content_Types].xml",
-        "docx_temp"
+    std::vector<size_t> changed;
+    for (size_t i = 0; i < cache.chunks.size(); i++) {
+        if (cache.chunks[i].changed) {
+            changed.push_back(i);
+        }
+    }
+
+    std::atomic<size_t> next_job(0);
+    DOCXAllocations::Scope* allocation_scope = DOCXAllocations::current_scope();
+    auto worker = [&]() {
+        DOCXAllocations::ThreadScope thread_scope(allocation_scope);
+        std::string xml;
+        for (size_t j = next_job++; j < changed.size(); j = next_job++) {
+            DocumentChunk& chunk = cache.chunks[changed[j]];
+            xml.clear();
+            write_paragraphs(chunk.first_paragraph, chunk.first_paragraph + chunk.paragraph_count, xml, settings, style_ids);
+            chunk.compressed = DOCXZip::compress_piece(xml);
+            chunk.changed = false;
+        }
     };
 
-    for (size_t i = 0; i < files.size(); i++) {
-        std::string cur_file = files.at(i);
-        DOCXUtils::delete_file_or_folder(cur_file);
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < std::min(worker_count(), changed.size()); i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (size_t i = 0; i < pool.size(); i++) {
+        pool[i].join();
+    }
+
+    DOCXZip::Compressed document;
+    size_t compressed_size = 0;
+    for (size_t i = 0; i < cache.chunks.size(); i++) {
+        compressed_size += cache.chunks[i].compressed.data.size();
+    }
+    document.data.reserve(compressed_size + 4096);
+    DOCXZip::append_piece(document, DOCXZip::compress_piece(document_prolog()));
+    for (size_t i = 0; i < cache.chunks.size(); i++) {
+        DOCXZip::append_piece(document, cache.chunks[i].compressed);
+    }
+    DOCXZip::append_piece(document, DOCXZip::compress_piece(document_epilog()));
+    DOCXZip::end_pieces(document);
+    return document;
+}
+
+// Adds changed chunks for the paragraphs with about DOCUMENT_CHUNK_SIZE bytes of XML each
+inline void DOCX::split_chunk(std::vector<DocumentChunk>& chunks, size_t first_paragraph, size_t paragraph_count) const {
+    size_t end = first_paragraph + paragraph_count;
+    size_t chunk_start = first_paragraph;
+    size_t chunk_size = 0;
+    for (size_t i = first_paragraph; i < end; i++) {
+        chunk_size += estimate_xml_size(i);
+        if (chunk_size >= DOCUMENT_CHUNK_SIZE || i + 1 == end) {
+            chunks.push_back({chunk_start, i + 1 - chunk_start, true, DOCXZip::Compressed()});
+            chunk_start = i + 1;
+            chunk_size = 0;
+        }
+    }
+}
+
+inline size_t DOCX::estimate_xml_size(size_t index) const {
+    const ParagraphRecord& record = records[index];
+    size_t size = 64 + record.typeface_size + record.run_count * 64;
+    if (record.run_count > 0) {
+        const RunRecord& first = runs[record.first_run];
+        const RunRecord& last = runs[record.first_run + record.run_count - 1];
+        size += last.text_offset + last.text_size - first.text_offset;
+    }
+    return size;
+}
+
+// Whether paragraphs are written the same with both
+inline bool DOCX::same_output(const Settings& a, const Settings& b) {
+    return a.font_size == b.font_size
+        && a.latin_typeface == b.latin_typeface
+        && a.ea_typeface == b.ea_typeface
+        && a.cs_typeface == b.cs_typeface
+        && a.intern_run_formats == b.intern_run_formats
+        && a.coalesce_runs == b.coalesce_runs
+        && a.compact_markup == b.compact_markup
+        && a.explicit_run_defaults == b.explicit_run_defaults;
+}
+
+inline size_t DOCX::worker_count() {
+    if (thread_count == 0) {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+    return thread_count;
+}
+
+inline void DOCX::Paragraph::intern_formats(DOCX::FormatTable& formats, const DOCX::Settings& settings) const {
+    for (size_t i = 0; i < contents.size(); i++) {
+        formats.intern(contents[i], settings);
+    }
+}
+
+// Writes the whole package to sink, stats are filled in if it's not null
+inline void DOCX::save_package(std::function<void(const char* data, size_t len)> sink, SaveStats* stats) {
+    DOCXZip zip(sink);
+    write_package(zip, stats);
+
+    PhaseTimer timer(stats, zip);
+    size_t package_bytes = zip.bytes_written();
+    zip.finish();
+    timer.end("central_directory", zip.bytes_written() - package_bytes);
+
+    if (stats != nullptr) {
+        const std::vector<DOCXZip::Entry>& entries = zip.get_entries();
+        for (size_t i = 0; i < entries.size(); i++) {
+            stats->parts.push_back({entries[i].name, entries[i].seconds, entries[i].size, entries[i].compressed_size});
+        }
+        stats->bytes = zip.bytes_written();
+    }
+}
+
+inline void DOCX::write_package(DOCXZip& zip, SaveStats* stats) {
+    zip.set_thread_count(worker_count());
+    PhaseTimer timer(stats, zip);
+
+    FormatTable styles;
+    std::vector<size_t> style_ids;
+    if (settings.intern_run_formats) {
+        intern_formats(styles, style_ids);
+        timer.end("intern_formats");
+    }
+
+    write_fixed_parts(zip, settings);
+    timer.end("fixed_parts");
+    write_styles_part(zip, settings, styles);
+    timer.end("styles");
+
+    if (chunk_cache.enabled) {
+        zip.add_file("word/document.xml", write_document_chunks(settings.intern_run_formats ? style_ids.data() : nullptr));
+        timer.end("document_chunks");
+        return;
+    }
+
+    std::string document;
+    write_document(document, settings.intern_run_formats ? style_ids.data() : nullptr);
+    timer.end("serialize_document", document.size());
+    zip.add_file("word/document.xml", document);
+    timer.end("compress_document");
+}
+
+inline DOCX::PhaseTimer::PhaseTimer(SaveStats* set_stats, const DOCXZip& set_zip) :
+    stats(set_stats),
+    zip(set_zip),
+    first_entry(set_zip.get_entries().size()),
+    start(std::chrono::steady_clock::now())
+{
+    if (stats != nullptr) {
+        scope.emplace();
+    }
+}
+
+inline void DOCX::PhaseTimer::end(const char* name, size_t extra_bytes) {
+    if (stats == nullptr) {
+        return;
+    }
+
+    SaveStats::Entry& phase = stats->phases.emplace_back();
+    phase.name = name;
+    phase.seconds = DOCXUtils::seconds_since(start);
+    phase.bytes = extra_bytes;
+    const std::vector<DOCXZip::Entry>& entries = zip.get_entries();
+    for (size_t i = first_entry; i < entries.size(); i++) {
+        phase.bytes += entries[i].size;
+        phase.compressed_bytes += entries[i].compressed_size;
+    }
+    DOCXAllocations::Counts counts = scope->counts();
+    phase.allocations = counts.allocations;
+    phase.allocated_bytes = counts.bytes;
+    phase.peak_bytes = counts.peak_bytes;
+
+    first_entry = entries.size();
+    scope.reset();
+    scope.emplace();
+    start = std::chrono::steady_clock::now();
+}
+
+inline void DOCX::add_allocation_counts(SaveStats& stats, const DOCXAllocations::Scope& scope) {
+    DOCXAllocations::Counts counts = scope.counts();
+    stats.allocations = counts.allocations;
+    stats.allocated_bytes = counts.bytes;
+    stats.peak_bytes = counts.peak_bytes;
+}
+
+// Only the distinct formats have to be interned, not every run. style_ids gets the style of every format.
+inline void DOCX::intern_formats(FormatTable& styles, std::vector<size_t>& style_ids) {
+    pack_pending();
+    style_ids.resize(formats.size());
+    for (size_t i = 0; i < formats.size(); i++) {
+        style_ids[i] = styles.intern(formats[i], settings);
+    }
+}
+
+// Writes every part except word/document.xml and word/styles.xml
+inline void DOCX::write_fixed_parts(DOCXZip& zip, const Settings& settings) {
+    add_fixed_parts(settings, [&zip](const std::string& name, const DOCXZip::Compressed& content) {
+        zip.add_file(name, content);
+    });
+}
+
+inline void DOCX::write_styles_part(DOCXZip& zip, const Settings& settings, const FormatTable& formats) {
+    add_styles_part(settings, formats, [&zip](const std::string& name, const DOCXZip::Compressed& content) {
+        zip.add_file(name, content);
+    });
+}
+
+template <typename AddPart>
+void DOCX::add_fixed_parts(const Settings& settings, AddPart add) {
+    const DOCXUtils::ConstantParts& constant = DOCXUtils::constant_parts();
+    std::shared_ptr<const DOCXUtils::StyleParts> style = DOCXUtils::style_parts(settings);
+
+    // [Content_Types].xml goes first so that the package type can be detected early
+    add("[Content_Types].xml", constant.content_types);
+    add("_rels/.rels", constant.dotrels);
+
+    add("docProps/app.xml", *DOCXZip::compress_cached(DOCXUtils::app_file()));
+    add("docProps/core.xml", *DOCXZip::compress_cached(DOCXUtils::core_file()));
+
+    add("word/fontTable.xml", style->font_table);
+    add("word/settings.xml", constant.settings);
+    add("word/_rels/document.xml.rels", constant.document_xml_rels);
+    add("word/theme/theme1.xml", style->theme1);
+}
+
+// The cached styles.xml can only be used when there are no run formats to add to it
+template <typename AddPart>
+void DOCX::add_styles_part(const Settings& settings, const FormatTable& formats, AddPart add) {
+    if (formats.size() > 0) {
+        add("word/styles.xml", *DOCXZip::compress_cached(DOCXUtils::styles_file(settings, formats)));
+    } else {
+        add("word/styles.xml", DOCXUtils::style_parts(settings)->styles);
+    }
+}
+
+//////////////////////////////
+// StreamWriter definitions //
+//////////////////////////////
+
+// Like DOCX::save, the document is written to a temporary file that replaces fname on close()
+inline DOCX::StreamWriter::StreamWriter(std::string set_fname, DOCX::Settings set_settings) :
+    settings(set_settings),
+    fname(set_fname),
+    temp_fname(DOCXUtils::temp_fname_for(set_fname)),
+    ofs(temp_fname, std::ios::binary),
+    zip([this](const char* data, size_t len) { ofs.write(data, len); })
+{
+    if (!ofs) {
+        std::cerr << "Could not open file for writing: " << temp_fname << newl;
+    }
+    begin();
+}
+
+inline DOCX::StreamWriter::StreamWriter(std::ostream& os, DOCX::Settings set_settings) :
+    settings(set_settings),
+    zip([&os](const char* data, size_t len) { os.write(data, len); })
+{
+    begin();
+}
+
+inline DOCX::StreamWriter::StreamWriter(std::function<void(const char* data, size_t len)> sink, DOCX::Settings set_settings) :
+    settings(set_settings),
+    zip(sink)
+{
+    begin();
+}
+
+inline DOCX::StreamWriter::~StreamWriter() {
+    close();
+}
+
+inline void DOCX::StreamWriter::add_paragraph(const DOCX::Paragraph& paragraph) {
+    if (settings.intern_run_formats) {
+        paragraph.intern_formats(formats, settings);
+        paragraph.write(buffer, settings, &formats);
+    } else {
+        paragraph.write(buffer, settings);
+    }
+    if (buffer.size() >= BUFFER_SIZE) {
+        flush_buffer();
+    }
+}
+
+inline void DOCX::StreamWriter::add_empty_line(size_t count, size_t font_size) {
+    DOCX::Paragraph p;
+    p.default_font_size = font_size;
+    for (size_t i = 0; i < count; i++) {
+        add_paragraph(p);
+    }
+}
+
+inline void DOCX::StreamWriter::close() {
+    if (closed) {
+        return;
+    }
+    closed = true;
+
+    buffer += DOCX::document_epilog();
+    flush_buffer();
+    zip.end_file();
+    if (settings.intern_run_formats) {
+        // Only complete once all the paragraphs have been seen
+        DOCX::write_styles_part(zip, settings, formats);
+    }
+    zip.finish();
+    if (ofs.is_open()) {
+        ofs.close();
+        DOCXUtils::replace_file(temp_fname, fname, !ofs.fail());
+    }
+}
+
+// Writes all the fixed parts of the package and opens word/document.xml, which is written last
+inline void DOCX::StreamWriter::begin() {
+    DOCX::write_fixed_parts(zip, settings);
+    if (!settings.intern_run_formats) {
+        DOCX::write_styles_part(zip, settings, formats);
+    }
+
+    zip.begin_file("word/document.xml");
+    buffer.reserve(BUFFER_SIZE * 2);
+    buffer += DOCX::document_prolog();
+}
+
+inline void DOCX::StreamWriter::flush_buffer() {
+    zip.write_file_data(buffer.data(), buffer.size());
+    buffer.clear();
+}
+
+//////////////////////////
+// Template definitions //
+//////////////////////////
+
+inline DOCX::Template::Template(DOCX& docx) {
+    FormatTable styles;
+    std::vector<size_t> style_ids;
+    if (docx.settings.intern_run_formats) {
+        docx.intern_formats(styles, style_ids);
+    }
+
+    DOCX::add_fixed_parts(docx.settings, [this](const std::string& name, const DOCXZip::Compressed& content) {
+        add_part(name, content);
+    });
+    DOCX::add_styles_part(docx.settings, styles, [this](const std::string& name, const DOCXZip::Compressed& content) {
+        add_part(name, content);
+    });
+
+    std::string document;
+    docx.write_document(document, docx.settings.intern_run_formats ? style_ids.data() : nullptr);
+    compile_document(document);
+}
+
+inline const std::vector<std::string>& DOCX::Template::get_fields() const {
+    return fields;
+}
+
+inline size_t DOCX::Template::field_index(std::string_view name) const {
+    for (size_t i = 0; i < fields.size(); i++) {
+        if (fields[i] == name) {
+            return i;
+        }
+    }
+    return SIZE_MAX;
+}
+
+inline void DOCX::Template::render(const std::vector<std::string_view>& values, std::string fname) const {
+    std::string temp_fname = DOCXUtils::temp_fname_for(fname);
+    std::ofstream ofs(temp_fname, std::ios::binary);
+    if (!ofs) {
+        std::cerr << "Could not open file for writing: " << temp_fname << newl;
+        return;
+    }
+    render(values, [&ofs](const char* data, size_t len) {
+        ofs.write(data, len);
+    });
+    ofs.close();
+    DOCXUtils::replace_file(temp_fname, fname, !ofs.fail());
+}
+
+inline void DOCX::Template::render(const std::vector<std::string_view>& values, std::function<void(const char* data, size_t len)> sink) const {
+    DOCXZip::Compressed document;
+    document.data.reserve(document_size + 64 * slots.size());
+    std::string escaped;
+    for (size_t i = 0; i < slots.size(); i++) {
+        DOCXZip::append_piece(document, segments[i]);
+        escaped.clear();
+        if (slots[i] < values.size()) {
+            DOCXUtils::append_escaped(escaped, values[slots[i]]);
+        }
+        DOCXZip::append_stored_piece(document, escaped);
+    }
+    DOCXZip::append_piece(document, segments.back());
+    DOCXZip::end_pieces(document);
+
+    DOCXZip zip(sink);
+    for (size_t i = 0; i < parts.size(); i++) {
+        zip.add_file(parts[i].first, parts[i].second);
+    }
+    zip.add_file("word/document.xml", document);
+    zip.finish();
+}
+
+inline void DOCX::Template::render_to_buffer(const std::vector<std::string_view>& values, std::string& buffer) const {
+    render(values, [&buffer](const char* data, size_t len) {
+        buffer.append(data, len);
+    });
+}
+
+inline void DOCX::Template::add_part(const std::string& name, const DOCXZip::Compressed& content) {
+    parts.emplace_back(name, content);
+}
+
+// Fields are looked for in the serialized XML, where the text of a run is escaped but braces
+// are left alone
+inline void DOCX::Template::compile_document(std::string_view document) {
+    size_t segment_start = 0;
+    size_t pos = document.find("{{");
+    while (pos != std::string_view::npos) {
+        size_t name_size = field_name_size(document.substr(pos + 2));
+        if (name_size == 0 || document.substr(pos + 2 + name_size, 2) != "}}") {
+            pos = document.find("{{", pos + 1);
+            continue;
+        }
+
+        std::string_view name = document.substr(pos + 2, name_size);
+        size_t index = field_index(name);
+        if (index == SIZE_MAX) {
+            index = fields.size();
+            fields.emplace_back(name);
+        }
+        segments.push_back(DOCXZip::compress_piece(document.substr(segment_start, pos - segment_start)));
+        slots.push_back(index);
+        segment_start = pos + 2 + name_size + 2;
+        pos = document.find("{{", segment_start);
+    }
+    segments.push_back(DOCXZip::compress_piece(document.substr(segment_start)));
+
+    for (size_t i = 0; i < segments.size(); i++) {
+        document_size += segments[i].data.size();
     }
 }
 
+inline size_t DOCX::Template::field_name_size(std::string_view str) {
+    size_t i = 0;
+    while (i < str.size() && (std::isalnum(static_cast<unsigned char>(str[i])) || str[i] == '_' || str[i] == '.' || str[i] == '-')) {
+        i++;
+    }
+    return i;
+}
+
 //////////////////////
 // Text definitions //
 //////////////////////
 
-inline DOCX::Text::Text(std::string set_text) {
-    text = set_text;
+inline DOCX::Text::Text(std::string_view set_text) :
+    text(set_text)
+{}
+
+inline void DOCX::Text::set_text(std::string_view set_text) {
+    text.assign(set_text);
 }
 
-////////////////////////////
-// DOCX Utils definitions //
-////////////////////////////
+inline void DOCX::Text::set_typeface(std::string_view set_typeface) {
+    typeface.assign(set_typeface);
+}
 
-inline std::string DOCXUtils::latin_typeface = "Georgia";
-inline std::string DOCXUtils::ea_typeface = "Noto Serif JP";
-inline std::string DOCXUtils::cs_typeface = "Noto Serif JP";
+inline void DOCX::Text::set_color(std::string_view set_color) {
+    color.assign(set_color);
+}
 
-inline void DOCXUtils::mkdir(std::string dirpath) {
-    std::filesystem::create_directory(dirpath);
+inline void DOCX::Text::set_highlight(std::string_view set_highlight) {
+    highlight.assign(set_highlight);
 }
 
-inline void DOCXUtils::write_file(std::string fpath, std::string content) {
-    std::ofstream ofs(fpath);
-    ofs << content;
-    ofs.close();
+inline void DOCX::Text::set_bg_color(std::string_view set_bg_color) {
+    bg_color.assign(set_bg_color);
 }
 
-inline void DOCXUtils::delete_file_or_folder(std::string dirpath) {
-    std::filesystem::remove(dirpath);
+inline bool DOCX::Text::same_format(const Text& other) const {
+    return size == other.size && bold == other.bold && italic == other.italic && underline == other.underline
+        && strikethrough == other.strikethrough && typeface == other.typeface && color == other.color
+        && highlight == other.highlight && bg_color == other.bg_color;
 }
 
-inline std::string DOCXUtils::content_types_file() {
-    XML::Node types("Types");
-    types.attributes["xmlns"] = "http://schemas.openxmlformats.org/package/2006/content-types";
-    {
-        XML::Node def1("Default");
-        def1.attributes["Extension"] = "xml";
-        def1.attributes["ContentType"] = "application/xml";
-        def1.self_closing = true;
-        types.add_child(def1);
-
-        XML::Node def2("Default");
-        def2.attributes["Extension"] = "rels";
-        def2.attributes["ContentType"] = "application/vnd.openxmlformats-package.relationships+xml";
-        def2.self_closing = true;
-        types.add_child(def2);
-
-        XML::Node def3("Default");
-        def3.attributes["Extension"] = "png";
-        def3.attributes["ContentType"] = "image/png";
-        def3.self_closing = true;
-        types.add_child(def3);
-
-        XML::Node def4("Default");
-        def4.attributes["Extension"] = "jpeg";
-        def4.attributes["ContentType"] = "image/jpeg";
-        def4.self_closing = true;
-        types.add_child(def4);
-
-        XML::Node over1("Override");
-        over1.attributes["PartName"] = "/_rels/.rels";
-        over1.attributes["ContentType"] = "application/vnd.openxmlformats-package.relationships+xml";
-        over1.self_closing = true;
-        types.add_child(over1);
-
-        XML::Node over2("Override");
-        over2.attributes["PartName"] = "/docProps/core.xml";
-        over2.attributes["ContentType"] = "application/vnd.openxmlformats-package.core-properties+xml";
-        over2.self_closing = true;
-        types.add_child(over2);
-
-        XML::Node over3("Override");
-        over3.attributes["PartName"] = "/docProps/app.xml";
-        over3.attributes["ContentType"] = "application/vnd.openxmlformats-officedocument.extended-properties+xml";
-        over3.self_closing = true;
-        types.add_child(over3);
-
-        XML::Node over4("Override");
-        over4.attributes["PartName"] = "/word/_rels/document.xml.rels";
-        over4.attributes["ContentType"] = "application/vnd.openxmlformats-package.relationships+xml";
-        over4.self_closing = true;
-        types.add_child(over4);
-
-        XML::Node over5("Override");
-        over5.attributes["PartName"] = "/word/document.xml";
-        over5.attributes["ContentType"] = "application/vnd.openxmlformats-officedocument.wordprocessingml.document.main+xml";
-        over5.self_closing = true;
-        types.add_child(over5);
-
-        XML::Node over6("Override");
-        over6.attributes["PartName"] = "/word/styles.xml";
-        over6.attributes["ContentType"] = "application/vnd.openxmlformats-officedocument.wordprocessingml.styles+xml";
-        over6.self_closing = true;
-        types.add_child(over6);
-
-        XML::Node over7("Override");
-        over7.attributes["PartName"] = "/word/fontTable.xml";
-        over7.attributes["ContentType"] = "application/vnd.openxmlformats-officedocument.wordprocessingml.fontTable+xml";
-        over7.self_closing = true;
-        types.add_child(over7);
-
-        XML::Node over8("Override");
-        over8.attributes["PartName"] = "/word/settings.xml";
-        over8.attributes["ContentType"] = "application/vnd.openxmlformats-officedocument.wordprocessingml.settings+xml";
-        over8.self_closing = true;
-        types.add_child(over8);
-        
-        XML::Node over9("Override");
-        over9.attributes["PartName"] = "/word/theme/theme1.xml";
-        over9.attributes["ContentType"] = "application/vnd.openxmlformats-officedocument.theme+xml";
-        over9.self_closing = true;
-        types.add_child(over9);
-    }
-    return types.get_string();
+inline void DOCX::Text::copy_format(const Text& other) {
+    typeface = other.typeface;
+    color = other.color;
+    highlight = other.highlight;
+    bg_color = other.bg_color;
+    bold = other.bold;
+    italic = other.italic;
+    underline = other.underline;
+    strikethrough = other.strikethrough;
+    size = other.size;
 }
 
-inline std::string DOCXUtils::dotrels_file() {
-    XML::Node rels("Relationships");
-    rels.attributes["xmlns"] = "http://schemas.openxmlformats.org/package/2006/relationships";
-    {
-        XML::Node rel1("Relationship");
-        rel1.attributes["Id"] = "rId1";
-        rel1.attributes["Type"] = "http://schemas.openxmlformats.org/officedocument/2006/relationships/metadata/core-properties";
-        rel1.attributes["Target"] = "docProps/core.xml";
-        rels.add_child(rel1);
+inline size_t DOCX::Text::format_hash() const {
+    std::hash<std::string_view> string_hash;
+    size_t h = string_hash(typeface);
+    h = h * 31 + string_hash(color);
+    h = h * 31 + string_hash(highlight);
+    h = h * 31 + string_hash(bg_color);
+    h = h * 31 + size;
+    h = h * 31 + (bold | (italic << 1) | (underline << 2) | (strikethrough << 3));
+    return h;
+}
+
+inline bool DOCX::Text::has_properties(const DOCX::Settings& settings) const {
+    return settings.explicit_run_defaults || size != settings.font_size || bold || italic || underline || strikethrough
+        || typeface != "" || color != "" || highlight != "" || bg_color != "";
+}
+
+inline void DOCX::Text::write_properties(std::string& out, const DOCX::Settings& settings) const {
+    if (size != settings.font_size || settings.explicit_run_defaults) {
+        out += "<w:sz w:val=\"";
+        DOCXUtils::append_uint(out, size * 2); // because half points
+        out += "\"/>";
+    }
+    if (bold) {
+        out += "<w:b/><w:bCs/>";
+    }
+    if (italic) {
+        out += "<w:i/><w:iCs/>";
+    }
+    if (underline) {
+        out += "<w:u w:val=\"single\"/>";
+    }
+    if (strikethrough) {
+        out += "<w:strike/>";
+    }
+    if (typeface != "") {
+        out += "<w:rFonts w:ascii=\"";
+        DOCXUtils::append_escaped(out, typeface);
+        out += "\" w:eastAsia=\"";
+        DOCXUtils::append_escaped(out, typeface);
+        out += "\" w:hAnsi=\"";
+        DOCXUtils::append_escaped(out, typeface);
+        out += "\" w:cs=\"";
+        DOCXUtils::append_escaped(out, typeface);
+        out += "\"/>";
+    } else if (settings.explicit_run_defaults) {
+        out += "<w:rFonts w:ascii=\"";
+        DOCXUtils::append_escaped(out, settings.latin_typeface);
+        out += "\" w:eastAsia=\"";
+        DOCXUtils::append_escaped(out, settings.ea_typeface);
+        out += "\" w:hAnsi=\"";
+        DOCXUtils::append_escaped(out, settings.latin_typeface);
+        out += "\" w:cs=\"";
+        DOCXUtils::append_escaped(out, settings.cs_typeface);
+        out += "\"/>";
+    }
+    if (color != "") {
+        out += "<w:color w:val=\"";
+        DOCXUtils::append_escaped(out, color);
+        out += "\"/>";
+    }
+    if (highlight != "") {
+        out += "<w:highlight w:val=\"";
+        DOCXUtils::append_escaped(out, highlight);
+        out += "\"/>";
+    }
+    if (bg_color != "") {
+        out += "<w:shd w:val=\"clear\" w:fill=\"";
+        DOCXUtils::append_escaped(out, bg_color);
+        out += "\"/>";
+    }
+}
+
+/////////////////////////////
+// FormatTable definitions //
+/////////////////////////////
+
+inline size_t DOCX::FormatTable::intern(const Text& t, const DOCX::Settings& settings) {
+    size_t id = find(t, settings);
+    if (id != NONE || !t.has_properties(settings)) {
+        return id;
+    }
+
+    id = formats.size();
+    formats.emplace_back().copy_format(t);
+    ids_by_hash.emplace(t.format_hash(), id);
+    return id;
+}
 
-        XML::Node rel2("Relationship");
-        rel2.attributes["Id"] = "rId2";
-        rel2.attributes["Type"] = "http://schemas.openxmlformats.org/officeDocument/2006/relationships/extended-properties";
-        rel2.attributes["Target"] = "docProps/app.xml";
-        rels.add_child(rel2);
+// Only reads the table, so it can be called from several threads at once
+inline size_t DOCX::FormatTable::find(const Text& t, const DOCX::Settings& settings) const {
+    if (!t.has_properties(settings)) {
+        return NONE;
+    }
+    auto range = ids_by_hash.equal_range(t.format_hash());
+    for (auto it = range.first; it != range.second; it++) {
+        if (formats[it->second].same_format(t)) {
+            return it->second;
+        }
+    }
+    return NONE;
+}
 
-        XML::Node rel3("Relationship");
-        rel3.attributes["Id"] = "rId3";
-        rel3.attributes["Type"] = "http://schemas.openxmlformats.org/officeDocument/2006/relationships/officeDocument";
-        rel3.attributes["Target"] = "word/document.xml";
-        rels.add_child(rel3);
+inline size_t DOCX::FormatTable::size() const {
+    return formats.size();
+}
+
+inline void DOCX::FormatTable::write_styles(std::string& out, const DOCX::Settings& settings) const {
+    for (size_t i = 0; i < formats.size(); i++) {
+        out += "<w:style w:type=\"character\" w:customStyle=\"1\" w:styleId=\"";
+        append_style_id(out, i);
+        out += "\"><w:name w:val=\"Run Format ";
+        DOCXUtils::append_uint(out, i + 1);
+        out += "\"/><w:rPr>";
+        formats[i].write_properties(out, settings);
+        out += "</w:rPr></w:style>";
     }
-    return rels.get_string();
+}
+
+inline void DOCX::FormatTable::append_style_id(std::string& out, size_t id) {
+    out += "RunFormat";
+    DOCXUtils::append_uint(out, id + 1);
+}
+
+////////////////////////////
+// DOCX Utils definitions //
+////////////////////////////
+
+inline std::string DOCXUtils::latin_typeface = "Georgia";
+inline std::string DOCXUtils::ea_typeface = "Noto Serif JP";
+inline std::string DOCXUtils::cs_typeface = "Noto Serif JP";
+
+inline std::string DOCXUtils::content_types_file() {
+    return std::string(content_types_xml());
+}
+
+inline std::string DOCXUtils::dotrels_file() {
+    return std::string(dotrels_xml());
 }
 
 inline std::string DOCXUtils::app_file() {
@@ -751,405 +3198,1840 @@ inline std::string DOCXUtils::core_file() {
 }
 
 inline std::string DOCXUtils::font_table_file() {
-    XML::Node fonts("w:fonts");
-    fonts.attributes["xmlns:w"] = "http://schemas.openxmlformats.org/wordprocessingml/2006/main";
-    fonts.attributes["xmlns:r"] = "http://schemas.openxmlformats.org/officeDocument/2006/relationships";
-    {
-        XML::Node font("w:font");
-        font.attributes["w:name"] = latin_typeface;
-        {
-            XML::Node charset("w:charset");
-            charset.attributes["w:val"] = "00";
-            charset.self_closing = true;
-            font.add_child(charset);
-
-            XML::Node family("w:family");
-            family.attributes["w:val"] = "roman";
-            family.self_closing = true;
-            font.add_child(family);
+    return font_table_file(DOCX::default_settings());
+}
 
-            XML::Node pitch("w:pitch");
-            pitch.attributes["w:val"] = "variable";
-            pitch.self_closing = true;
-            font.add_child(pitch);
-        }
-        fonts.add_child(font);
-    }
-    return fonts.get_string();
+inline std::string DOCXUtils::font_table_file(const DOCX::Settings& settings) {
+    return fill_template(font_table_template(), settings);
 }
 
 inline std::string DOCXUtils::settings_file() {
-    XML::Node settings("w:settings");
-    settings.attributes["xmlns:w"] = "http://schemas.openxmlformats.org/wordprocessingml/2006/main";
-    {
-        XML::Node compat("w:compat");
-        {
-            XML::Node compatset("w:compatSetting");
-            compatset.attributes["w:name"] = "compatibilityMode";
-            compatset.attributes["w:uri"] = "http://schemas.microsoft.com/office/word";
-            compatset.attributes["w:val"] = "15";
-            compatset.self_closing = true;
-            compat.add_child(compatset);
-        }
-        settings.add_child(compat);
-    }
-    return settings.get_string();
+    return std::string(settings_xml());
 }
 
 inline std::string DOCXUtils::styles_file() {
-    XML::Node styles("w:styles");
-    styles.attributes["xmlns:w"] = "http://schemas.openxmlformats.org/wordprocessingml/2006/main";
-    styles.attributes["xmlns:w14"] = "http://schemas.microsoft.com/office/word/2010/wordml";
-    styles.attributes["xmlns:mc"] = "http://schemas.openxmlformats.org/markup-compatibility/2006";
-    styles.attributes["mc:Ignorable"] = "w14";
-    {
-        XML::Node docdefs("w:docDefaults");
-        {
-            XML::Node rprdef1("w:rPrDefault");
-            {
-                XML::Node rpr("w:rPr");
-                {
-                    XML::Node rfonts("w:rFonts");
-                    rfonts.attributes["w:ascii"] = latin_typeface;
-                    rfonts.attributes["w:hAnsi"] = latin_typeface;
-                    rfonts.attributes["w:eastAsia"] = ea_typeface;
-                    rfonts.attributes["w:cs"] = cs_typeface;
-                    rfonts.self_closing = true;
-                    rpr.add_child(rfonts);
-
-                    XML::Node kern("w:kern");
-                    kern.attributes["w:val"] = "2";
-                    kern.self_closing = true;
-                    rpr.add_child(kern);
-
-                    XML::Node sz("w:sz");
-                    sz.attributes["w:val"] = "24";
-                    sz.self_closing = true;
-                    rpr.add_child(sz);
+    return styles_file(DOCX::default_settings());
+}
 
-                    XML::Node szcs("w:szCs");
-                    szcs.attributes["w:val"] = "24";
-                    szcs.self_closing = true;
-                    rpr.add_child(szcs);
+inline std::string DOCXUtils::styles_file(const DOCX::Settings& settings) {
+    return fill_template(styles_template(), settings);
+}
 
-                    XML::Node lang("w:lang");
-                    lang.attributes["w:val"] = "en-US";
-                    lang.self_closing = true;
-                    rpr.add_child(lang);
-                }
-                rprdef1.add_child(rpr);
-            }
-            docdefs.add_child(rprdef1);
+inline std::string DOCXUtils::styles_file(const DOCX::Settings& settings, const DOCX::FormatTable& formats) {
+    std::string styles = styles_file(settings);
+    std::string run_styles;
+    formats.write_styles(run_styles, settings);
+    styles.insert(styles.rfind("</w:styles>"), run_styles);
+    return styles;
+}
 
-            XML::Node pprdef("w:pPrDefault");
-            {
-                XML::Node ppr("w:pPr");
-                {
-                    XML::Node win("w:windowControl");
-                    win.self_closing = true;
-                    ppr.add_child(win);
-
-                    XML::Node sup("w:suppressAutoHyphens");
-                    sup.attributes["w:val"] = "true";
-                    sup.self_closing = true;
-                    ppr.add_child(sup);
-                }
-                pprdef.add_child(ppr);
-            }
-            docdefs.add_child(pprdef);
-        }
-        styles.add_child(docdefs);
+inline std::string DOCXUtils::document_xml_rels_file() {
+    return std::string(document_xml_rels_xml());
+}
 
-        XML::Node style("w:style");
-        style.attributes["w:type"] = "paragraph";
-        style.attributes["w:default"] = "1";
-        style.attributes["w:styleId"] = "Normal";
-        {
-            XML::Node name("w:name");
-            name.attributes["w:val"] = "Normal";
-            name.self_closing = true;
-            style.add_child(name);
+inline std::string DOCXUtils::theme1_file() {
+    return theme1_file(DOCX::default_settings());
+}
 
-            XML::Node qformat("w:qFormat");
-            qformat.self_closing = true;
-            style.add_child(qformat);
+inline std::string DOCXUtils::theme1_file(const DOCX::Settings& settings) {
+    return fill_template(theme1_template(), settings);
+}
 
-            XML::Node rpr("w:rPr");
-            {
-                XML::Node rfonts("w:rFonts");
-                rfonts.attributes["w:ascii"] = latin_typeface;
-                rfonts.attributes["w:hAnsi"] = latin_typeface;
-                rfonts.attributes["w:eastAsia"] = ea_typeface;
-                rfonts.attributes["w:cs"] = cs_typeface;
-                rfonts.self_closing = true;
-                rpr.add_child(rfonts);
-            }
-            style.add_child(rpr);
+inline constexpr uint32_t DOCXUtils::crc32_of(std::string_view data) {
+    // Bitwise CRC-32 (same polynomial as ZIP), slow but usable in constant expressions
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < data.size(); i++) {
+        crc ^= static_cast<unsigned char>(data[i]);
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
         }
-        styles.add_child(style);
     }
-    return styles.get_string();
+    return ~crc;
 }
 
-inline std::string DOCXUtils::document_xml_rels_file() {
-    XML::Node rels("Relationships");
-    rels.attributes["xmlns"] = "http://schemas.openxmlformats.org/package/2006/relationships";
-    {
-        XML::Node rel1("Relationship");
-        rel1.attributes["Id"] = "rId1";
-        rel1.attributes["Type"] = "http://schemas.openxmlformats.org/officeDocument/2006/relationships/styles";
-        rel1.attributes["Target"] = "styles.xml";
-        rels.add_child(rel1);
+inline constexpr std::string_view DOCXUtils::content_types_xml() {
+    return
+        R"(<?xml version="1.0" encoding="UTF-8" standalone="yes"?>)" "\n"
+        R"(<Types xmlns="http://schemas.openxmlformats.org/package/2006/content-types">)"
+            R"(<Default Extension="xml" ContentType="application/xml"/>)"
+            R"(<Default Extension="rels" ContentType="application/vnd.openxmlformats-package.relationships+xml"/>)"
+            R"(<Default Extension="png" ContentType="image/png"/>)"
+            R"(<Default Extension="jpeg" ContentType="image/jpeg"/>)"
+            R"(<Override PartName="/_rels/.rels" ContentType="application/vnd.openxmlformats-package.relationships+xml"/>)"
+            R"(<Override PartName="/docProps/core.xml" ContentType="application/vnd.openxmlformats-package.core-properties+xml"/>)"
+            R"(<Override PartName="/docProps/app.xml" ContentType="application/vnd.openxmlformats-officedocument.extended-properties+xml"/>)"
+            R"(<Override PartName="/word/_rels/document.xml.rels" ContentType="application/vnd.openxmlformats-package.relationships+xml"/>)"
+            R"(<Override PartName="/word/document.xml" ContentType="application/vnd.openxmlformats-officedocument.wordprocessingml.document.main+xml"/>)"
+            R"(<Override PartName="/word/styles.xml" ContentType="application/vnd.openxmlformats-officedocument.wordprocessingml.styles+xml"/>)"
+            R"(<Override PartName="/word/fontTable.xml" ContentType="application/vnd.openxmlformats-officedocument.wordprocessingml.fontTable+xml"/>)"
+            R"(<Override PartName="/word/settings.xml" ContentType="application/vnd.openxmlformats-officedocument.wordprocessingml.settings+xml"/>)"
+            R"(<Override PartName="/word/theme/theme1.xml" ContentType="application/vnd.openxmlformats-officedocument.theme+xml"/>)"
+        R"(</Types>)";
+}
 
-        XML::Node rel2("Relationship");
-        rel2.attributes["Id"] = "rId2";
-        rel2.attributes["Type"] = "http://schemas.openxmlformats.org/officeDocument/2006/relationships/fontTable";
-        rel2.attributes["Target"] = "fontTable.xml";
-        rels.add_child(rel2);
+inline constexpr std::string_view DOCXUtils::dotrels_xml() {
+    return
+        R"(<?xml version="1.0" encoding="UTF-8" standalone="yes"?>)" "\n"
+        R"(<Relationships xmlns="http://schemas.openxmlformats.org/package/2006/relationships">)"
+            R"(<Relationship Id="rId1" Type="http://schemas.openxmlformats.org/officedocument/2006/relationships/metadata/core-properties" Target="docProps/core.xml"/>)"
+            R"(<Relationship Id="rId2" Type="http://schemas.openxmlformats.org/officeDocument/2006/relationships/extended-properties" Target="docProps/app.xml"/>)"
+            R"(<Relationship Id="rId3" Type="http://schemas.openxmlformats.org/officeDocument/2006/relationships/officeDocument" Target="word/document.xml"/>)"
+        R"(</Relationships>)";
+}
 
-        XML::Node rel3("Relationship");
-        rel3.attributes["Id"] = "rId3";
-        rel3.attributes["Type"] = "http://schemas.openxmlformats.org/officeDocument/2006/relationships/settings";
-        rel3.attributes["Target"] = "settings.xml";
-        rels.add_child(rel3);
+inline constexpr std::string_view DOCXUtils::settings_xml() {
+    return
+        R"(<?xml version="1.0" encoding="UTF-8" standalone="yes"?>)" "\n"
+        R"(<w:settings xmlns:w="http://schemas.openxmlformats.org/wordprocessingml/2006/main">)"
+            R"(<w:compat>)"
+                R"(<w:compatSetting w:name="compatibilityMode" w:uri="http://schemas.microsoft.com/office/word" w:val="15"/>)"
+            R"(</w:compat>)"
+        R"(</w:settings>)";
+}
 
-        XML::Node rel4("Relationship");
-        rel4.attributes["Id"] = "rId4";
-        rel4.attributes["Type"] = "http://schemas.openxmlformats.org/officeDocument/2006/relationships/theme";
-        rel4.attributes["Target"] = "theme/theme1.xml";
-        rels.add_child(rel4);
-    }
-    return rels.get_string();
+inline constexpr std::string_view DOCXUtils::document_xml_rels_xml() {
+    return
+        R"(<?xml version="1.0" encoding="UTF-8" standalone="yes"?>)" "\n"
+        R"(<Relationships xmlns="http://schemas.openxmlformats.org/package/2006/relationships">)"
+            R"(<Relationship Id="rId1" Type="http://schemas.openxmlformats.org/officeDocument/2006/relationships/styles" Target="styles.xml"/>)"
+            R"(<Relationship Id="rId2" Type="http://schemas.openxmlformats.org/officeDocument/2006/relationships/fontTable" Target="fontTable.xml"/>)"
+            R"(<Relationship Id="rId3" Type="http://schemas.openxmlformats.org/officeDocument/2006/relationships/settings" Target="settings.xml"/>)"
+            R"(<Relationship Id="rId4" Type="http://schemas.openxmlformats.org/officeDocument/2006/relationships/theme" Target="theme/theme1.xml"/>)"
+        R"(</Relationships>)";
 }
 
-inline std::string DOCXUtils::theme1_file() {
-    XML::Node theme1("a:theme");
-    theme1.attributes["xmlns:a"] = "http://schemas.openxmlformats.org/drawingml/2006/main";
-    theme1.attributes["xmlns:r"] = "http://schemas.openxmlformats.org/officeDocument/2006/relationships";
-    theme1.attributes["name"] = "MinimalTheme";
-    {
-        XML::Node theme_elems("a:themeElements");
-        {
-            XML::Node clr_scheme("a:clrScheme");
-            clr_scheme.attributes["name"] = "MinimalColors";
-            {
-                XML::Node dk1("a:dk1");
-                {
-                    XML::Node srgb("a:srgbClr");
-                    srgb.attributes["val"] = "000000";
-                    srgb.self_closing = true;
-                    dk1.add_child(srgb);
-                }
-                clr_scheme.add_child(dk1);
+// {latin_typeface}, {ea_typeface}, {cs_typeface} and {font_size} are filled in by fill_template()
+inline constexpr std::string_view DOCXUtils::font_table_template() {
+    return
+        R"(<?xml version="1.0" encoding="UTF-8" standalone="yes"?>)" "\n"
+        R"(<w:fonts xmlns:w="http://schemas.openxmlformats.org/wordprocessingml/2006/main" xmlns:r="http://schemas.openxmlformats.org/officeDocument/2006/relationships">)"
+            R"(<w:font w:name="{latin_typeface}">)"
+                R"(<w:charset w:val="00"/>)"
+                R"(<w:family w:val="roman"/>)"
+                R"(<w:pitch w:val="variable"/>)"
+            R"(</w:font>)"
+        R"(</w:fonts>)";
+}
 
-                XML::Node lt1("a:lt1");
-                {
-                    XML::Node srgb("a:srgbClr");
-                    srgb.attributes["val"] = "FFFFFF";
-                    srgb.self_closing = true;
-                    lt1.add_child(srgb);
-                }
-                clr_scheme.add_child(lt1);
+inline constexpr std::string_view DOCXUtils::styles_template() {
+    return
+        R"(<?xml version="1.0" encoding="UTF-8" standalone="yes"?>)" "\n"
+        R"(<w:styles xmlns:w="http://schemas.openxmlformats.org/wordprocessingml/2006/main" xmlns:w14="http://schemas.microsoft.com/office/word/2010/wordml" xmlns:mc="http://schemas.openxmlformats.org/markup-compatibility/2006" mc:Ignorable="w14">)"
+            R"(<w:docDefaults>)"
+                R"(<w:rPrDefault>)"
+                    R"(<w:rPr>)"
+                        R"(<w:rFonts w:ascii="{latin_typeface}" w:hAnsi="{latin_typeface}" w:eastAsia="{ea_typeface}" w:cs="{cs_typeface}"/>)"
+                        R"(<w:kern w:val="2"/>)"
+                        R"(<w:sz w:val="{font_size}"/>)"
+                        R"(<w:szCs w:val="{font_size}"/>)"
+                        R"(<w:lang w:val="en-US"/>)"
+                    R"(</w:rPr>)"
+                R"(</w:rPrDefault>)"
+                R"(<w:pPrDefault>)"
+                    R"(<w:pPr>)"
+                        R"(<w:windowControl/>)"
+                        R"(<w:suppressAutoHyphens w:val="true"/>)"
+                    R"(</w:pPr>)"
+                R"(</w:pPrDefault>)"
+            R"(</w:docDefaults>)"
+            R"(<w:style w:type="paragraph" w:default="1" w:styleId="Normal">)"
+                R"(<w:name w:val="Normal"/>)"
+                R"(<w:qFormat/>)"
+                R"(<w:rPr>)"
+                    R"(<w:rFonts w:ascii="{latin_typeface}" w:hAnsi="{latin_typeface}" w:eastAsia="{ea_typeface}" w:cs="{cs_typeface}"/>)"
+                R"(</w:rPr>)"
+            R"(</w:style>)"
+        R"(</w:styles>)";
+}
 
-                XML::Node dk2("a:dk2");
-                {
-                    XML::Node srgb("a:srgbClr");
-                    srgb.attributes["val"] = "000000";
-                    srgb.self_closing = true;
-                    dk2.add_child(srgb);
-                }
-                clr_scheme.add_child(dk2);
+inline constexpr std::string_view DOCXUtils::theme1_template() {
+    return
+        R"(<?xml version="1.0" encoding="UTF-8" standalone="yes"?>)" "\n"
+        R"(<a:theme xmlns:a="http://schemas.openxmlformats.org/drawingml/2006/main" xmlns:r="http://schemas.openxmlformats.org/officeDocument/2006/relationships" name="MinimalTheme">)"
+            R"(<a:themeElements>)"
+                R"(<a:clrScheme name="MinimalColors">)"
+                    R"(<a:dk1>)"
+                        R"(<a:srgbClr val="000000"/>)"
+                    R"(</a:dk1>)"
+                    R"(<a:lt1>)"
+                        R"(<a:srgbClr val="FFFFFF"/>)"
+                    R"(</a:lt1>)"
+                    R"(<a:dk2>)"
+                        R"(<a:srgbClr val="000000"/>)"
+                    R"(</a:dk2>)"
+                    R"(<a:lt2>)"
+                        R"(<a:srgbClr val="FFFFFF"/>)"
+                    R"(</a:lt2>)"
+                    R"(<a:accent1>)"
+                        R"(<a:srgbClr val="808080"/>)"
+                    R"(</a:accent1>)"
+                    R"(<a:accent2>)"
+                        R"(<a:srgbClr val="808080"/>)"
+                    R"(</a:accent2>)"
+                    R"(<a:accent3>)"
+                        R"(<a:srgbClr val="808080"/>)"
+                    R"(</a:accent3>)"
+                    R"(<a:accent4>)"
+                        R"(<a:srgbClr val="808080"/>)"
+                    R"(</a:accent4>)"
+                    R"(<a:accent5>)"
+                        R"(<a:srgbClr val="808080"/>)"
+                    R"(</a:accent5>)"
+                    R"(<a:accent6>)"
+                        R"(<a:srgbClr val="808080"/>)"
+                    R"(</a:accent6>)"
+                    R"(<a:hlink>)"
+                        R"(<a:srgbClr val="0000FF"/>)"
+                    R"(</a:hlink>)"
+                    R"(<a:folHlink>)"
+                        R"(<a:srgbClr val="808080"/>)"
+                    R"(</a:folHlink>)"
+                R"(</a:clrScheme>)"
+                R"(<a:fontScheme name="DefaultFont">)"
+                    R"(<a:majorFont>)"
+                        R"(<a:latin typeface="{latin_typeface}"/>)"
+                        R"(<a:ea typeface="{ea_typeface}"/>)"
+                        R"(<a:cs typeface="{cs_typeface}"/>)"
+                    R"(</a:majorFont>)"
+                    R"(<a:minorFont>)"
+                        R"(<a:latin typeface="{latin_typeface}"/>)"
+                        R"(<a:ea typeface="{ea_typeface}"/>)"
+                        R"(<a:cs typeface="{cs_typeface}"/>)"
+                    R"(</a:minorFont>)"
+                R"(</a:fontScheme>)"
+                R"(<a:fmtScheme name="MinimalFormat">)"
+                    R"(<a:fillStyleLst>)"
+                        R"(<a:solidFill>)"
+                            R"(<a:schemeClr val="phClr"/>)"
+                        R"(</a:solidFill>)"
+                    R"(</a:fillStyleLst>)"
+                    R"(<a:lnStyleLst>)"
+                        R"(<a:ln w="9525">)"
+                            R"(<a:solidFill>)"
+                                R"(<a:schemeClr val="phClr"/>)"
+                            R"(</a:solidFill>)"
+                        R"(</a:ln>)"
+                    R"(</a:lnStyleLst>)"
+                    R"(<a:effectStyleLst>)"
+                        R"(<a:effectStyle>)"
+                            R"(<a:effectLst/>)"
+                        R"(</a:effectStyle>)"
+                    R"(</a:effectStyleLst>)"
+                    R"(<a:bgFillStyleLst>)"
+                        R"(<a:solidFill>)"
+                            R"(<a:schemeClr val="phClr"/>)"
+                        R"(</a:solidFill>)"
+                    R"(</a:bgFillStyleLst>)"
+                R"(</a:fmtScheme>)"
+            R"(</a:themeElements>)"
+        R"(</a:theme>)";
+}
 
-                XML::Node lt2("a:lt2");
-                {
-                    XML::Node srgb("a:srgbClr");
-                    srgb.attributes["val"] = "FFFFFF";
-                    srgb.self_closing = true;
-                    lt2.add_child(srgb);
-                }
-                clr_scheme.add_child(lt2);
+inline const DOCXUtils::ConstantParts& DOCXUtils::constant_parts() {
+    // The CRCs are computed at compile time, the compression happens once on first use
+    static constexpr uint32_t content_types_crc = crc32_of(content_types_xml());
+    static constexpr uint32_t dotrels_crc = crc32_of(dotrels_xml());
+    static constexpr uint32_t settings_crc = crc32_of(settings_xml());
+    static constexpr uint32_t document_xml_rels_crc = crc32_of(document_xml_rels_xml());
+
+    static const ConstantParts parts = {
+        DOCXZip::compress(content_types_xml(), content_types_crc),
+        DOCXZip::compress(dotrels_xml(), dotrels_crc),
+        DOCXZip::compress(settings_xml(), settings_crc),
+        DOCXZip::compress(document_xml_rels_xml(), document_xml_rels_crc)
+    };
+    return parts;
+}
 
-                XML::Node acc1("a:accent1");
-                {
-                    XML::Node srgb("a:srgbClr");
-                    srgb.attributes["val"] = "808080";
-                    srgb.self_closing = true;
-                    acc1.add_child(srgb);
-                }
-                clr_scheme.add_child(acc1);
+inline std::shared_ptr<const DOCXUtils::StyleParts> DOCXUtils::style_parts(const DOCX::Settings& settings) {
+    static std::mutex cache_mutex;
+    static std::map<std::string, std::shared_ptr<const StyleParts>> cache;
 
-                XML::Node acc2("a:accent2");
-                {
-                    XML::Node srgb("a:srgbClr");
-                    srgb.attributes["val"] = "808080";
-                    srgb.self_closing = true;
-                    acc2.add_child(srgb);
-                }
-                clr_scheme.add_child(acc2);
+    std::string key = settings.latin_typeface + '\0' + settings.ea_typeface + '\0' + settings.cs_typeface + '\0';
+    append_uint(key, settings.font_size);
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto it = cache.find(key);
+        if (it != cache.end()) {
+            return it->second;
+        }
+    }
 
-                XML::Node acc3("a:accent3");
-                {
-                    XML::Node srgb("a:srgbClr");
-                    srgb.attributes["val"] = "808080";
-                    srgb.self_closing = true;
-                    acc3.add_child(srgb);
-                }
-                clr_scheme.add_child(acc3);
+    // Compressed without holding the lock so other documents aren't held up
+    std::shared_ptr<StyleParts> parts = std::make_shared<StyleParts>();
+    parts->font_table = DOCXZip::compress(font_table_file(settings));
+    parts->styles = DOCXZip::compress(styles_file(settings));
+    parts->theme1 = DOCXZip::compress(theme1_file(settings));
 
-                XML::Node acc4("a:accent4");
-                {
-                    XML::Node srgb("a:srgbClr");
-                    srgb.attributes["val"] = "808080";
-                    srgb.self_closing = true;
-                    acc4.add_child(srgb);
-                }
-                clr_scheme.add_child(acc4);
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (cache.size() >= STYLE_PARTS_CACHE_SIZE) {
+        cache.clear();
+    }
+    cache[key] = parts;
+    return parts;
+}
 
-                XML::Node acc5("a:accent5");
-                {
-                    XML::Node srgb("a:srgbClr");
-                    srgb.attributes["val"] = "808080";
-                    srgb.self_closing = true;
-                    acc5.add_child(srgb);
-                }
-                clr_scheme.add_child(acc5);
+inline std::string DOCXUtils::fill_template(std::string_view xml_template, const DOCX::Settings& settings) {
+    std::string out;
+    out.reserve(xml_template.size() + 64);
 
-                XML::Node acc6("a:accent6");
-                {
-                    XML::Node srgb("a:srgbClr");
-                    srgb.attributes["val"] = "808080";
-                    srgb.self_closing = true;
-                    acc6.add_child(srgb);
-                }
-                clr_scheme.add_child(acc6);
+    size_t pos = 0;
+    while (pos < xml_template.size()) {
+        size_t open = xml_template.find('{', pos);
+        if (open == std::string_view::npos) {
+            break;
+        }
+        size_t close = xml_template.find('}', open);
+        std::string_view key = xml_template.substr(open + 1, close - open - 1);
+
+        out.append(xml_template.substr(pos, open - pos));
+        if (key == "latin_typeface") {
+            append_escaped(out, settings.latin_typeface);
+        } else if (key == "ea_typeface") {
+            append_escaped(out, settings.ea_typeface);
+        } else if (key == "cs_typeface") {
+            append_escaped(out, settings.cs_typeface);
+        } else if (key == "font_size") {
+            append_uint(out, settings.font_size * 2); // because half points
+        } else {
+            std::cerr << "Unknown template key: " << key << newl;
+        }
+        pos = close + 1;
+    }
+    out.append(xml_template.substr(pos));
+    return out;
+}
 
-                XML::Node hlink("a:hlink");
-                {
-                    XML::Node srgb("a:srgbClr");
-                    srgb.attributes["val"] = "0000FF";
-                    srgb.self_closing = true;
-                    hlink.add_child(srgb);
-                }
-                clr_scheme.add_child(hlink);
+inline void DOCXUtils::append_escaped(std::string& out, std::string_view str) {
+    size_t start = 0;
+    for (size_t i = 0; i < str.size(); i++) {
+        const char* entity = nullptr;
+        switch (str[i]) {
+            case '&': entity = "&amp;"; break;
+            case '<': entity = "&lt;"; break;
+            case '>': entity = "&gt;"; break;
+            case '"': entity = "&quot;"; break;
+            default: break;
+        }
+        if (entity != nullptr) {
+            out.append(str.substr(start, i - start));
+            out += entity;
+            start = i + 1;
+        }
+    }
+    out.append(str.substr(start));
+}
 
-                XML::Node fol("a:folHlink");
-                {
-                    XML::Node srgb("a:srgbClr");
-                    srgb.attributes["val"] = "808080";
-                    srgb.self_closing = true;
-                    fol.add_child(srgb);
-                }
-                clr_scheme.add_child(fol);
+inline void DOCXUtils::append_uint(std::string& out, size_t val) {
+    char digits[20];
+    size_t len = 0;
+    do {
+        digits[len++] = static_cast<char>('0' + val % 10);
+        val /= 10;
+    } while (val > 0);
+
+    size_t start = out.size();
+    out.resize(start + len);
+    for (size_t i = 0; i < len; i++) {
+        out[start + i] = digits[len - 1 - i];
+    }
+}
+
+inline size_t DOCXUtils::parse_uint(std::string_view str) {
+    size_t val = 0;
+    for (size_t i = 0; i < str.size() && str[i] >= '0' && str[i] <= '9'; i++) {
+        val = val * 10 + (str[i] - '0');
+    }
+    return val;
+}
+
+// Unique per call, across threads and processes, and in the same directory as fname so that the
+// rename in replace_file() doesn't have to cross file systems
+inline std::string DOCXUtils::temp_fname_for(const std::string& fname) {
+    static std::atomic<uint64_t> counter(0);
+    thread_local std::mt19937_64 rng(std::random_device{}() ^ std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+    std::string temp_fname = resolve_symlinks(fname) + ".tmp-";
+    append_uint(temp_fname, rng());
+    temp_fname += "-";
+    append_uint(temp_fname, counter++);
+    return temp_fname;
+}
+
+inline double DOCXUtils::seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline bool DOCXUtils::replace_file(const std::string& temp_fname, const std::string& fname, bool write_ok) {
+    std::error_code ec;
+    if (!write_ok) {
+        std::cerr << "Could not write file: " << temp_fname << newl;
+        std::filesystem::remove(temp_fname, ec);
+        return false;
+    }
+
+    // The temp file was created with the default mode, the file it replaces keeps its own
+    std::string target = resolve_symlinks(fname);
+    std::filesystem::file_status target_status = std::filesystem::status(target, ec);
+    if (!ec && std::filesystem::exists(target_status)) {
+        std::filesystem::permissions(temp_fname, target_status.permissions(), ec);
+    }
+
+    std::filesystem::rename(temp_fname, target, ec);
+    if (ec) {
+        std::cerr << "Could not rename " << temp_fname << " to " << target << ": " << ec.message() << newl;
+        std::filesystem::remove(temp_fname, ec);
+        return false;
+    }
+    return true;
+}
+
+// Follows the links one at a time, so a link to a file that doesn't exist yet resolves too. Gives
+// up on loops after as many links as Linux follows.
+inline std::string DOCXUtils::resolve_symlinks(const std::string& fname) {
+    std::filesystem::path path(fname);
+    std::error_code ec;
+    for (size_t i = 0; i < 40 && std::filesystem::is_symlink(std::filesystem::symlink_status(path, ec)); i++) {
+        std::filesystem::path link = std::filesystem::read_symlink(path, ec);
+        if (ec) {
+            break;
+        }
+        path = link.is_absolute() ? link : path.parent_path() / link;
+    }
+    return path.string();
+}
+
+//////////////////////////
+// DOCX Zip definitions //
+//////////////////////////
+
+inline DOCXZip::DOCXZip(Sink set_sink) {
+    sink = set_sink;
+}
+
+inline void DOCXZip::set_thread_count(size_t count) {
+    thread_count = count;
+}
+
+inline void DOCXZip::add_file(const std::string& name, const std::string& content) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    add_file(name, compress_parallel(content, thread_count));
+    entries.back().seconds = DOCXUtils::seconds_since(start);
+}
+
+inline void DOCXZip::add_file(const std::string& name, const Compressed& compressed) {
+    add_raw_file(name, compressed.method, compressed.crc, compressed.size, { compressed.data });
+}
+
+inline void DOCXZip::add_raw_file(const std::string& name, uint16_t method, uint32_t crc, uint64_t size, const std::vector<std::string_view>& data, uint16_t flags) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Entry entry;
+    entry.name = name;
+    entry.flags = flags & FLAG_UTF8_NAME;
+    entry.method = method;
+    entry.crc = crc;
+    entry.size = size;
+    entry.offset = offset;
+    for (size_t i = 0; i < data.size(); i++) {
+        entry.compressed_size += data[i].size();
+    }
+
+    write_local_header(entry);
+    for (size_t i = 0; i < data.size(); i++) {
+        write(data[i].data(), data[i].size());
+    }
+    entry.seconds = DOCXUtils::seconds_since(start);
+    entries.push_back(entry);
+}
+
+inline DOCXZip::Compressed DOCXZip::compress(std::string_view content) {
+    return compress(content, crc32_z(0L, reinterpret_cast<const Bytef*>(content.data()), content.size()));
+}
+
+inline DOCXZip::Compressed DOCXZip::compress(std::string_view content, uint32_t crc) {
+    Compressed compressed;
+    compressed.crc = crc;
+    compressed.size = content.size();
+
+    // Fall back to storing the data as is if deflate doesn't make it any smaller
+    compressed.method = METHOD_DEFLATE;
+    if (!deflate_raw(content, compressed.data) || compressed.data.size() >= content.size()) {
+        compressed.data = std::string(content);
+        compressed.method = METHOD_STORE;
+    }
+    return compressed;
+}
+
+// Same idea as pigz: the content is split into blocks that are deflated independently on the
+// worker threads. Every block except the last one ends with a sync flush so that it finishes
+// on a byte boundary, which makes the concatenated blocks a single valid deflate stream. Each
+// block is primed with the 32 KiB before it as dictionary so compression stays close to the
+// sequential result. The CRCs of the blocks are combined at the end.
+inline DOCXZip::Compressed DOCXZip::compress_parallel(std::string_view content, size_t workers) {
+    if (workers <= 1 || content.size() < PARALLEL_BLOCK_SIZE * 2) {
+        return compress(content);
+    }
+
+    size_t block_count = (content.size() + PARALLEL_BLOCK_SIZE - 1) / PARALLEL_BLOCK_SIZE;
+    std::vector<std::string> blocks(block_count);
+    std::vector<uint32_t> crcs(block_count);
+    std::atomic<size_t> next_block(0);
+    std::atomic<bool> failed(false);
+    DOCXAllocations::Scope* allocation_scope = DOCXAllocations::current_scope();
+
+    auto worker = [&]() {
+        DOCXAllocations::ThreadScope thread_scope(allocation_scope);
+        for (size_t b = next_block++; b < block_count; b = next_block++) {
+            size_t start = b * PARALLEL_BLOCK_SIZE;
+            std::string_view block = content.substr(start, PARALLEL_BLOCK_SIZE);
+            size_t dictionary_size = std::min(start, WINDOW_SIZE);
+            std::string_view dictionary = content.substr(start - dictionary_size, dictionary_size);
+
+            if (!deflate_block(dictionary, block, b == block_count - 1, blocks[b])) {
+                failed = true;
             }
-            theme_elems.add_child(clr_scheme);
+            crcs[b] = crc32(0L, reinterpret_cast<const Bytef*>(block.data()), block.size());
+        }
+    };
 
-            XML::Node font_scheme("a:fontScheme");
-            font_scheme.attributes["name"] = "DefaultFont";
-            {
-                XML::Node major("a:majorFont");
-                {
-                    XML::Node latin("a:latin");
-                    latin.attributes["typeface"] = latin_typeface;
-                    latin.self_closing = true;
-                    major.add_child(latin);
-
-                    XML::Node ea("a:ea");
-                    ea.attributes["typeface"] = ea_typeface;
-                    ea.self_closing = true;
-                    major.add_child(ea);
-
-                    XML::Node cs("a:cs");
-                    cs.attributes["typeface"] = cs_typeface;
-                    cs.self_closing = true;
-                    major.add_child(cs);
-                }
-                font_scheme.add_child(major);
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < std::min(workers, block_count); i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (size_t i = 0; i < pool.size(); i++) {
+        pool[i].join();
+    }
 
-                XML::Node minor("a:minorFont");
-                {
-                    XML::Node latin("a:latin");
-                    latin.attributes["typeface"] = latin_typeface;
-                    latin.self_closing = true;
-                    minor.add_child(latin);
-
-                    XML::Node ea("a:ea");
-                    ea.attributes["typeface"] = ea_typeface;
-                    ea.self_closing = true;
-                    minor.add_child(ea);
-
-                    XML::Node cs("a:cs");
-                    cs.attributes["typeface"] = cs_typeface;
-                    cs.self_closing = true;
-                    minor.add_child(cs);
+    Compressed compressed;
+    compressed.size = content.size();
+    compressed.crc = crcs[0];
+    size_t total = blocks[0].size();
+    for (size_t b = 1; b < block_count; b++) {
+        size_t block_size = std::min(PARALLEL_BLOCK_SIZE, content.size() - b * PARALLEL_BLOCK_SIZE);
+        compressed.crc = crc32_combine(compressed.crc, crcs[b], block_size);
+        total += blocks[b].size();
+    }
+
+    if (failed || total >= content.size()) {
+        compressed.data = std::string(content);
+        compressed.method = METHOD_STORE;
+        return compressed;
+    }
+
+    compressed.method = METHOD_DEFLATE;
+    compressed.data.reserve(total);
+    for (size_t b = 0; b < block_count; b++) {
+        compressed.data += blocks[b];
+        std::string().swap(blocks[b]);
+    }
+    return compressed;
+}
+
+inline std::shared_ptr<const DOCXZip::Compressed> DOCXZip::compress_cached(std::string_view content) {
+    typedef std::tuple<size_t, uint32_t, size_t> Key; // hash, CRC and size
+    struct CachedPart {
+        std::string content; // compared on every hit, neither the hash nor the CRC resists deliberate collisions
+        std::shared_ptr<const Compressed> compressed;
+    };
+    static std::mutex cache_mutex;
+    static std::map<Key, CachedPart> cache;
+
+    uint32_t crc = crc32_z(0L, reinterpret_cast<const Bytef*>(content.data()), content.size());
+    if (content.size() > COMPRESSED_CACHE_MAX_PART_SIZE) {
+        return std::make_shared<const Compressed>(compress(content, crc));
+    }
+
+    Key key(std::hash<std::string_view>()(content), crc, content.size());
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto it = cache.find(key);
+        if (it != cache.end() && it->second.content == content) {
+            return it->second.compressed;
+        }
+    }
+
+    // Compressed without holding the lock so other documents aren't held up
+    std::shared_ptr<const Compressed> compressed = std::make_shared<const Compressed>(compress(content, crc));
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (cache.size() >= COMPRESSED_CACHE_SIZE) {
+        cache.clear();
+    }
+    cache[key] = CachedPart{ std::string(content), compressed };
+    return compressed;
+}
+
+// Deflate blocks that aren't the last one, ended with a sync flush
+inline DOCXZip::Compressed DOCXZip::compress_piece(std::string_view content) {
+    Compressed piece;
+    piece.method = METHOD_DEFLATE;
+    piece.crc = crc32_z(0L, reinterpret_cast<const Bytef*>(content.data()), content.size());
+    piece.size = content.size();
+    if (!deflate_block(std::string_view(), content, false, piece.data)) {
+        append_stored_blocks(piece.data, content, false);
+    }
+    return piece;
+}
+
+inline void DOCXZip::append_piece(Compressed& part, const Compressed& piece) {
+    part.method = METHOD_DEFLATE;
+    part.crc = crc32_combine(part.crc, piece.crc, piece.size);
+    part.size += piece.size;
+    part.data += piece.data;
+}
+
+inline void DOCXZip::append_stored_piece(Compressed& part, std::string_view content) {
+    part.method = METHOD_DEFLATE;
+    part.crc = crc32_z(part.crc, reinterpret_cast<const Bytef*>(content.data()), content.size());
+    part.size += content.size();
+    append_stored_blocks(part.data, content, false);
+}
+
+// An empty last block
+inline void DOCXZip::end_pieces(Compressed& part) {
+    part.method = METHOD_DEFLATE;
+    append_stored_blocks(part.data, std::string_view(), true);
+}
+
+// The time of a streamed entry is only what is spent in begin_file(), write_file_data() and end_file()
+inline void DOCXZip::begin_file(const std::string& name) {
+    cur_entry_start = std::chrono::steady_clock::now();
+    cur_entry = Entry();
+    cur_entry.name = name;
+    cur_entry.flags = FLAG_DATA_DESCRIPTOR;
+    cur_entry.method = METHOD_DEFLATE;
+    cur_entry.crc = crc32(0L, Z_NULL, 0);
+    cur_entry.offset = offset;
+    write_local_header(cur_entry);
+
+    strm = {};
+    strm.zalloc = DOCXAllocations::zlib_alloc;
+    strm.zfree = DOCXAllocations::zlib_free;
+    strm_ready = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    if (!strm_ready) {
+        std::cerr << "Could not initialize deflate, storing " << name << " uncompressed" << newl;
+    }
+    strm_out.resize(1 << 16);
+    cur_entry.seconds = DOCXUtils::seconds_since(cur_entry_start);
+}
+
+inline void DOCXZip::write_file_data(const char* data, size_t len) {
+    cur_entry_start = std::chrono::steady_clock::now();
+    cur_entry.crc = crc32_z(cur_entry.crc, reinterpret_cast<const Bytef*>(data), len);
+    cur_entry.size += len;
+
+    if (!strm_ready) {
+        std::string blocks;
+        append_stored_blocks(blocks, std::string_view(data, len), false);
+        write(blocks);
+        cur_entry.compressed_size += blocks.size();
+    }
+    for (size_t done = 0; strm_ready && done < len;) { // avail_in is only 32 bits wide
+        size_t piece = std::min<size_t>(len - done, UINT_MAX);
+        strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data + done));
+        strm.avail_in = piece;
+        deflate_stream(Z_NO_FLUSH);
+        done += piece;
+    }
+    cur_entry.seconds += DOCXUtils::seconds_since(cur_entry_start);
+}
+
+inline void DOCXZip::end_file() {
+    cur_entry_start = std::chrono::steady_clock::now();
+    if (strm_ready) {
+        strm.next_in = Z_NULL;
+        strm.avail_in = 0;
+        deflate_stream(Z_FINISH);
+        deflateEnd(&strm);
+        strm_ready = false;
+    } else {
+        std::string last_block;
+        append_stored_blocks(last_block, std::string_view(), true);
+        write(last_block);
+        cur_entry.compressed_size += last_block.size();
+    }
+
+    // Sizes that don't fit in 32 bits are written with 64 bits, the central directory then
+    // has them in a ZIP64 extra field
+    std::string descriptor;
+    put32(descriptor, 0x08074b50); // data descriptor signature
+    put32(descriptor, cur_entry.crc);
+    if (needs_zip64(cur_entry.compressed_size) || needs_zip64(cur_entry.size)) {
+        put64(descriptor, cur_entry.compressed_size);
+        put64(descriptor, cur_entry.size);
+    } else {
+        put32(descriptor, cur_entry.compressed_size);
+        put32(descriptor, cur_entry.size);
+    }
+    write(descriptor);
+
+    cur_entry.seconds += DOCXUtils::seconds_since(cur_entry_start);
+    entries.push_back(cur_entry);
+}
+
+// Values that don't fit in their fields are set to all ones and written in ZIP64 records
+// instead, which are only added when they are needed
+inline void DOCXZip::finish() {
+    uint64_t cd_offset = offset;
+
+    std::string cd;
+    for (size_t i = 0; i < entries.size(); i++) {
+        const Entry& entry = entries.at(i);
+        std::string extra; // the values in the order the ZIP64 extra field has them
+        if (needs_zip64(entry.size)) {
+            put64(extra, entry.size);
+        }
+        if (needs_zip64(entry.compressed_size)) {
+            put64(extra, entry.compressed_size);
+        }
+        if (needs_zip64(entry.offset)) {
+            put64(extra, entry.offset);
+        }
+        uint16_t version = extra.empty() ? VERSION_DEFAULT : VERSION_ZIP64;
+
+        put32(cd, 0x02014b50); // central file header signature
+        put16(cd, version); // version made by
+        put16(cd, version); // version needed to extract
+        put16(cd, entry.flags);
+        put16(cd, entry.method);
+        put16(cd, DOS_TIME);
+        put16(cd, DOS_DATE);
+        put32(cd, entry.crc);
+        put32(cd, needs_zip64(entry.compressed_size) ? UINT32_MAX : entry.compressed_size);
+        put32(cd, needs_zip64(entry.size) ? UINT32_MAX : entry.size);
+        put16(cd, entry.name.size());
+        put16(cd, extra.empty() ? 0 : extra.size() + 4); // extra field length
+        put16(cd, 0); // file comment length
+        put16(cd, 0); // disk number start
+        put16(cd, 0); // internal file attributes
+        put32(cd, 0); // external file attributes
+        put32(cd, needs_zip64(entry.offset) ? UINT32_MAX : entry.offset);
+        cd += entry.name;
+        if (!extra.empty()) {
+            put16(cd, ZIP64_EXTRA_ID);
+            put16(cd, extra.size());
+            cd += extra;
+        }
+    }
+    write(cd);
+
+    bool zip64 = entries.size() >= 0xFFFF || needs_zip64(cd.size()) || needs_zip64(cd_offset);
+    std::string eocd;
+    if (zip64) {
+        uint64_t zip64_eocd_offset = offset;
+        put32(eocd, 0x06064b50); // ZIP64 end of central directory signature
+        put64(eocd, 44); // size of the rest of the record
+        put16(eocd, VERSION_ZIP64); // version made by
+        put16(eocd, VERSION_ZIP64); // version needed to extract
+        put32(eocd, 0); // number of this disk
+        put32(eocd, 0); // disk where central directory starts
+        put64(eocd, entries.size());
+        put64(eocd, entries.size());
+        put64(eocd, cd.size());
+        put64(eocd, cd_offset);
+
+        put32(eocd, 0x07064b50); // ZIP64 end of central directory locator signature
+        put32(eocd, 0); // disk with the ZIP64 end of central directory
+        put64(eocd, zip64_eocd_offset);
+        put32(eocd, 1); // total number of disks
+    }
+    put32(eocd, 0x06054b50); // end of central directory signature
+    put16(eocd, 0); // number of this disk
+    put16(eocd, 0); // disk where central directory starts
+    put16(eocd, zip64 ? 0xFFFF : entries.size());
+    put16(eocd, zip64 ? 0xFFFF : entries.size());
+    put32(eocd, zip64 ? UINT32_MAX : cd.size());
+    put32(eocd, zip64 ? UINT32_MAX : cd_offset);
+    put16(eocd, 0); // comment length
+    write(eocd);
+}
+
+inline const std::vector<DOCXZip::Entry>& DOCXZip::get_entries() const {
+    return entries;
+}
+
+inline size_t DOCXZip::bytes_written() const {
+    return offset;
+}
+
+inline void DOCXZip::write(const std::string& data) {
+    write(data.data(), data.size());
+}
+
+inline void DOCXZip::write(const char* data, size_t len) {
+    sink(data, len);
+    offset += len;
+}
+
+// Sizes and CRC are zero in the local header of streamed entries, they follow the data instead.
+// Sizes that don't fit in 32 bits are in a ZIP64 extra field, which then has both of them.
+inline void DOCXZip::write_local_header(const Entry& entry) {
+    bool streamed = (entry.flags & FLAG_DATA_DESCRIPTOR) != 0;
+    bool zip64 = !streamed && (needs_zip64(entry.size) || needs_zip64(entry.compressed_size));
+
+    std::string header;
+    put32(header, 0x04034b50); // local file header signature
+    put16(header, zip64 ? VERSION_ZIP64 : VERSION_DEFAULT); // version needed to extract
+    put16(header, entry.flags);
+    put16(header, entry.method);
+    put16(header, DOS_TIME);
+    put16(header, DOS_DATE);
+    put32(header, streamed ? 0 : entry.crc);
+    put32(header, streamed ? 0 : zip64 ? UINT32_MAX : entry.compressed_size);
+    put32(header, streamed ? 0 : zip64 ? UINT32_MAX : entry.size);
+    put16(header, entry.name.size());
+    put16(header, zip64 ? 20 : 0); // extra field length
+    header += entry.name;
+    if (zip64) {
+        put16(header, ZIP64_EXTRA_ID);
+        put16(header, 16);
+        put64(header, entry.size);
+        put64(header, entry.compressed_size);
+    }
+    write(header);
+}
+
+// Runs deflate on the pending input of the streamed entry and writes out whatever it produces
+inline void DOCXZip::deflate_stream(int flush) {
+    do {
+        strm.next_out = reinterpret_cast<Bytef*>(strm_out.data());
+        strm.avail_out = strm_out.size();
+        deflate(&strm, flush);
+        size_t produced = strm_out.size() - strm.avail_out;
+        write(strm_out.data(), produced);
+        cur_entry.compressed_size += produced;
+    } while (strm.avail_out == 0);
+}
+
+inline bool DOCXZip::deflate_raw(std::string_view content, std::string& out) {
+    return deflate_block(std::string_view(), content, true, out);
+}
+
+// Deflates block on its own, continuing after dictionary. Unless it's the last block, the
+// stream is left open and ends on a byte boundary so that more blocks can follow it.
+inline bool DOCXZip::deflate_block(std::string_view dictionary, std::string_view block, bool last, std::string& out) {
+    out.clear();
+    z_stream strm = {};
+    strm.zalloc = DOCXAllocations::zlib_alloc;
+    strm.zfree = DOCXAllocations::zlib_free;
+    // Negative window bits produce a raw deflate stream without the zlib header, as required by ZIP
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        std::cerr << "Could not initialize deflate" << newl;
+        return false;
+    }
+    if (!dictionary.empty()) {
+        deflateSetDictionary(&strm, reinterpret_cast<const Bytef*>(dictionary.data()), dictionary.size());
+    }
+
+    out.resize(deflateBound(&strm, block.size()) + 16); // sync flush adds a few bytes over the bound
+
+    size_t consumed = 0; // avail_in and avail_out are only 32 bits wide, block is passed on in pieces
+    size_t produced = 0;
+    while (true) {
+        if (strm.avail_in == 0 && consumed < block.size()) {
+            size_t piece = std::min<size_t>(block.size() - consumed, UINT_MAX);
+            strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(block.data() + consumed));
+            strm.avail_in = piece;
+            consumed += piece;
+        }
+        int flush = consumed < block.size() ? Z_NO_FLUSH : last ? Z_FINISH : Z_SYNC_FLUSH;
+        strm.next_out = reinterpret_cast<Bytef*>(&out[produced]);
+        strm.avail_out = std::min<size_t>(out.size() - produced, UINT_MAX);
+        deflate(&strm, flush);
+        produced = reinterpret_cast<char*>(strm.next_out) - out.data();
+        if (flush != Z_NO_FLUSH && strm.avail_out != 0) {
+            break;
+        }
+        if (produced == out.size()) {
+            out.resize(out.size() * 2);
+        }
+    }
+    out.resize(produced);
+    deflateEnd(&strm);
+    return true;
+}
+
+// Stored blocks start on a byte boundary: a header byte that says whether it's the last block,
+// then the length and its complement
+inline void DOCXZip::append_stored_blocks(std::string& out, std::string_view content, bool last) {
+    if (content.empty() && !last) {
+        return;
+    }
+    size_t i = 0;
+    do {
+        std::string_view block = content.substr(i, STORED_BLOCK_SIZE);
+        i += block.size();
+        out += last && i == content.size() ? '\1' : '\0';
+        put16(out, block.size());
+        put16(out, static_cast<uint16_t>(~block.size()));
+        out += block;
+    } while (i < content.size());
+}
+
+inline void DOCXZip::put16(std::string& out, uint16_t val) {
+    out += static_cast<char>(val & 0xFF);
+    out += static_cast<char>((val >> 8) & 0xFF);
+}
+
+inline void DOCXZip::put32(std::string& out, uint32_t val) {
+    put16(out, val & 0xFFFF);
+    put16(out, (val >> 16) & 0xFFFF);
+}
+
+inline void DOCXZip::put64(std::string& out, uint64_t val) {
+    put32(out, val & 0xFFFFFFFF);
+    put32(out, val >> 32);
+}
+
+// All ones in a 32 bit field means the value is in the ZIP64 extra field
+inline bool DOCXZip::needs_zip64(uint64_t val) {
+    return val >= UINT32_MAX;
+}
+
+/////////////////////////////////
+// DOCX Zip Reader definitions //
+/////////////////////////////////
+
+inline DOCXZipReader::~DOCXZipReader() {
+    close();
+}
+
+inline bool DOCXZipReader::open(const std::string& fname) {
+    close();
+#ifndef _WIN32
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Could not open file for reading: " << fname << newl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        std::cerr << "Could not read file: " << fname << newl;
+        ::close(fd);
+        return false;
+    }
+    void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Could not map file: " << fname << newl;
+        return false;
+    }
+    mapping = mapped;
+    mapping_size = st.st_size;
+    data = std::string_view(static_cast<const char*>(mapping), mapping_size);
+#else
+    std::ifstream ifs(fname, std::ios::binary);
+    if (!ifs) {
+        std::cerr << "Could not open file for reading: " << fname << newl;
+        return false;
+    }
+    file_contents.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    data = file_contents;
+#endif
+    if (!read_central_directory()) {
+        std::cerr << "Not a valid zip file: " << fname << newl;
+        close();
+        return false;
+    }
+    return true;
+}
+
+inline bool DOCXZipReader::open(std::string_view buffer) {
+    close();
+    data = buffer;
+    if (!read_central_directory()) {
+        std::cerr << "Not a valid zip file" << newl;
+        close();
+        return false;
+    }
+    return true;
+}
+
+inline void DOCXZipReader::close() {
+#ifndef _WIN32
+    if (mapping != nullptr) {
+        munmap(mapping, mapping_size);
+    }
+#endif
+    mapping = nullptr;
+    mapping_size = 0;
+    std::string().swap(file_contents);
+    data = std::string_view();
+    entries.clear();
+}
+
+inline const std::vector<DOCXZipReader::Entry>& DOCXZipReader::get_entries() const {
+    return entries;
+}
+
+inline const DOCXZipReader::Entry* DOCXZipReader::find(std::string_view name) const {
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].name == name) {
+            return &entries[i];
+        }
+    }
+    return nullptr;
+}
+
+inline std::string_view DOCXZipReader::compressed_data(const Entry& entry) const {
+    if (entry.offset > data.size() || data.size() - entry.offset < LOCAL_HEADER_SIZE) {
+        return std::string_view();
+    }
+    const char* header = data.data() + entry.offset;
+    if (get32(header) != 0x04034b50) {
+        return std::string_view();
+    }
+    // The name and extra field lengths in the local header may differ from the central directory
+    size_t start = size_t(entry.offset) + LOCAL_HEADER_SIZE + get16(header + 26) + get16(header + 28);
+    if (start > data.size() || entry.compressed_size > data.size() - start) {
+        return std::string_view();
+    }
+    return data.substr(start, entry.compressed_size);
+}
+
+inline bool DOCXZipReader::read(const Entry& entry, std::string& out) const {
+    std::string_view compressed = compressed_data(entry);
+    if (compressed.size() != entry.compressed_size) {
+        std::cerr << "Broken zip entry: " << entry.name << newl;
+        return false;
+    }
+
+    out.clear();
+    if (entry.method == 0) { // stored
+        out.assign(compressed);
+    } else if (entry.method == 8) { // deflated
+        // The size in the header is only trusted as far as the compressed data could really
+        // inflate to, out grows as the data arrives and stops one byte past the size
+        out.reserve(std::min<size_t>(entry.size, compressed.size() * MAX_DEFLATE_RATIO));
+        z_stream strm = {};
+        strm.zalloc = DOCXAllocations::zlib_alloc;
+        strm.zfree = DOCXAllocations::zlib_free;
+        if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+            std::cerr << "Could not initialize inflate" << newl;
+            return false;
+        }
+        size_t consumed = 0; // avail_in and avail_out are only 32 bits wide, the data is passed on in pieces
+        size_t produced = 0;
+        int result = Z_OK;
+        while (result == Z_OK) {
+            if (produced == out.size()) {
+                if (produced > entry.size) { // more data than the header says
+                    break;
                 }
-                font_scheme.add_child(minor);
+                out.resize(std::min<size_t>(std::max(out.capacity(), produced + READ_CHUNK_SIZE), size_t(entry.size) + 1));
             }
-            theme_elems.add_child(font_scheme);
+            if (strm.avail_in == 0 && consumed < compressed.size()) {
+                size_t piece = std::min<size_t>(compressed.size() - consumed, UINT_MAX);
+                strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data() + consumed));
+                strm.avail_in = piece;
+                consumed += piece;
+            }
+            strm.next_out = reinterpret_cast<Bytef*>(&out[produced]);
+            strm.avail_out = std::min<size_t>(out.size() - produced, UINT_MAX);
+            result = inflate(&strm, Z_NO_FLUSH);
+            produced = reinterpret_cast<char*>(strm.next_out) - out.data();
+        }
+        inflateEnd(&strm);
+        out.resize(produced);
+        if (result != Z_STREAM_END || produced != entry.size) {
+            std::cerr << "Could not inflate zip entry: " << entry.name << newl;
+            return false;
+        }
+    } else {
+        std::cerr << "Unsupported compression method " << entry.method << " in zip entry: " << entry.name << newl;
+        return false;
+    }
 
-            XML::Node fmt("a:fmtScheme");
-            fmt.attributes["name"] = "MinimalFormat";
-            {
-                XML::Node fill("a:fillStyleLst");
-                {
-                    XML::Node solid("a:solidFill");
-                    {
-                        XML::Node scheme("a:schemeClr");
-                        scheme.attributes["val"] = "phClr";
-                        scheme.self_closing = true;
-                        solid.add_child(scheme);
-                    }
-                    fill.add_child(solid);
-                }
-                fmt.add_child(fill);
+    if (out.size() != entry.size || crc32_z(0L, reinterpret_cast<const Bytef*>(out.data()), out.size()) != entry.crc) {
+        std::cerr << "CRC mismatch in zip entry: " << entry.name << newl;
+        return false;
+    }
+    return true;
+}
 
-                XML::Node ln("a:lnStyleLst");
-                {
-                    XML::Node l("a:ln");
-                    l.attributes["w"] = "9525";
-                    {
-                        XML::Node solid("a:solidFill");
-                        {
-                            XML::Node scheme("a:schemeClr");
-                            scheme.attributes["val"] = "phClr";
-                            scheme.self_closing = true;
-                            solid.add_child(scheme);
-                        }
-                        l.add_child(solid);
-                    }
-                    ln.add_child(l);
-                }
-                fmt.add_child(ln);
+inline bool DOCXZipReader::read(const Entry& entry, std::function<void(const char* data, size_t len)> sink) const {
+    std::string_view compressed = compressed_data(entry);
+    if (compressed.size() != entry.compressed_size) {
+        std::cerr << "Broken zip entry: " << entry.name << newl;
+        return false;
+    }
 
-                XML::Node effect("a:effectStyleLst");
-                {
-                    XML::Node efs("a:effectStyle");
-                    {
-                        XML::Node efsl("a:effectLst");
-                        efsl.self_closing = true;
-                        efs.add_child(efsl);
-                    }
-                    effect.add_child(efs);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    size_t size = 0;
+    if (entry.method == 0) { // stored
+        for (size_t i = 0; i < compressed.size(); i += READ_CHUNK_SIZE) {
+            std::string_view chunk = compressed.substr(i, READ_CHUNK_SIZE);
+            crc = crc32(crc, reinterpret_cast<const Bytef*>(chunk.data()), chunk.size());
+            sink(chunk.data(), chunk.size());
+        }
+        size = compressed.size();
+    } else if (entry.method == 8) { // deflated
+        z_stream strm = {};
+        strm.zalloc = DOCXAllocations::zlib_alloc;
+        strm.zfree = DOCXAllocations::zlib_free;
+        if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+            std::cerr << "Could not initialize inflate" << newl;
+            return false;
+        }
+        size_t consumed = 0; // avail_in is only 32 bits wide, the data is passed on in pieces
+        std::vector<char> chunk(READ_CHUNK_SIZE);
+        int result = Z_OK;
+        while (result == Z_OK) {
+            if (strm.avail_in == 0 && consumed < compressed.size()) {
+                size_t piece = std::min<size_t>(compressed.size() - consumed, UINT_MAX);
+                strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data() + consumed));
+                strm.avail_in = piece;
+                consumed += piece;
+            }
+            strm.next_out = reinterpret_cast<Bytef*>(chunk.data());
+            strm.avail_out = chunk.size();
+            result = inflate(&strm, Z_NO_FLUSH);
+            size_t produced = chunk.size() - strm.avail_out;
+            if (result != Z_OK && result != Z_STREAM_END) {
+                break;
+            }
+            if (produced == 0 && result == Z_OK && strm.avail_in == 0 && consumed == compressed.size()) { // the input ended before the stream did
+                result = Z_DATA_ERROR;
+                break;
+            }
+            crc = crc32(crc, reinterpret_cast<const Bytef*>(chunk.data()), produced);
+            size += produced;
+            sink(chunk.data(), produced);
+        }
+        inflateEnd(&strm);
+        if (result != Z_STREAM_END) {
+            std::cerr << "Could not inflate zip entry: " << entry.name << newl;
+            return false;
+        }
+    } else {
+        std::cerr << "Unsupported compression method " << entry.method << " in zip entry: " << entry.name << newl;
+        return false;
+    }
+
+    if (size != entry.size || crc != entry.crc) {
+        std::cerr << "CRC mismatch in zip entry: " << entry.name << newl;
+        return false;
+    }
+    return true;
+}
+
+// The end of central directory record is at the very end unless there's an archive comment, which
+// can be up to 65535 bytes long
+inline bool DOCXZipReader::read_central_directory() {
+    if (data.size() < EOCD_SIZE) {
+        return false;
+    }
+    size_t eocd = data.size() - EOCD_SIZE;
+    size_t search_end = data.size() > EOCD_SIZE + 0xFFFF ? data.size() - EOCD_SIZE - 0xFFFF : 0;
+    while (get32(data.data() + eocd) != 0x06054b50) {
+        if (eocd == search_end) {
+            return false;
+        }
+        eocd--;
+    }
+
+    const char* p = data.data() + eocd;
+    size_t count = get16(p + 10);
+    size_t cd_size = get32(p + 12);
+    size_t cd_offset = get32(p + 16);
+    size_t cd_end = eocd; // where the central directory has to end
+    if (eocd >= ZIP64_LOCATOR_SIZE && get32(p - ZIP64_LOCATOR_SIZE) == 0x07064b50) {
+        if (!read_zip64_end(eocd, count, cd_size, cd_offset, cd_end)) {
+            return false;
+        }
+    }
+    if (cd_offset > cd_end || cd_size > cd_end - cd_offset) {
+        return false;
+    }
+
+    entries.reserve(count);
+    size_t pos = cd_offset;
+    for (size_t i = 0; i < count; i++) {
+        if (pos + CD_HEADER_SIZE > cd_offset + cd_size) {
+            return false;
+        }
+        p = data.data() + pos;
+        if (get32(p) != 0x02014b50) {
+            return false;
+        }
+        size_t name_size = get16(p + 28);
+        size_t entry_size = CD_HEADER_SIZE + name_size + get16(p + 30) + get16(p + 32);
+        if (pos + entry_size > cd_offset + cd_size) {
+            return false;
+        }
+
+        Entry& entry = entries.emplace_back();
+        entry.flags = get16(p + 8);
+        entry.method = get16(p + 10);
+        entry.crc = get32(p + 16);
+        entry.compressed_size = get32(p + 20);
+        entry.size = get32(p + 24);
+        entry.offset = get32(p + 42);
+        entry.name.assign(p + CD_HEADER_SIZE, name_size);
+        if (!read_zip64_extra(std::string_view(p + CD_HEADER_SIZE + name_size, get16(p + 30)), entry)) {
+            return false;
+        }
+        pos += entry_size;
+    }
+    return true;
+}
+
+// The ZIP64 end of central directory locator right before the end of central directory record
+// points to the ZIP64 record, which has the 64 bit entry count and central directory size and offset
+inline bool DOCXZipReader::read_zip64_end(size_t eocd, size_t& count, size_t& cd_size, size_t& cd_offset, size_t& cd_end) const {
+    const char* locator = data.data() + eocd - ZIP64_LOCATOR_SIZE;
+    uint64_t zip64_eocd = get64(locator + 8);
+    if (zip64_eocd > eocd - ZIP64_LOCATOR_SIZE || eocd - ZIP64_LOCATOR_SIZE - zip64_eocd < ZIP64_EOCD_SIZE) {
+        return false;
+    }
+    const char* p = data.data() + zip64_eocd;
+    if (get32(p) != 0x06064b50) {
+        return false;
+    }
+    count = get64(p + 32);
+    cd_size = get64(p + 40);
+    cd_offset = get64(p + 48);
+    cd_end = zip64_eocd;
+    // Every central directory header takes at least CD_HEADER_SIZE bytes, so count can't be
+    // larger than that allows, which keeps the reserve below sane
+    return count <= cd_size / CD_HEADER_SIZE;
+}
+
+// Fields that are all ones in the central directory header are in the ZIP64 extra field, in the
+// order size, compressed size, offset, each one only if its header field is all ones
+inline bool DOCXZipReader::read_zip64_extra(std::string_view extra, Entry& entry) {
+    bool size_in_extra = entry.size == UINT32_MAX;
+    bool compressed_size_in_extra = entry.compressed_size == UINT32_MAX;
+    bool offset_in_extra = entry.offset == UINT32_MAX;
+    if (!size_in_extra && !compressed_size_in_extra && !offset_in_extra) {
+        return true;
+    }
+    for (size_t pos = 0; pos + 4 <= extra.size(); ) {
+        uint16_t id = get16(extra.data() + pos);
+        size_t field_size = get16(extra.data() + pos + 2);
+        if (pos + 4 + field_size > extra.size()) {
+            return false;
+        }
+        if (id == 0x0001) {
+            const char* p = extra.data() + pos + 4;
+            const char* end = p + field_size;
+            if (size_in_extra) {
+                if (p + 8 > end) {
+                    return false;
+                }
+                entry.size = get64(p);
+                p += 8;
+            }
+            if (compressed_size_in_extra) {
+                if (p + 8 > end) {
+                    return false;
                 }
-                fmt.add_child(effect);
+                entry.compressed_size = get64(p);
+                p += 8;
+            }
+            if (offset_in_extra) {
+                if (p + 8 > end) {
+                    return false;
+                }
+                entry.offset = get64(p);
+            }
+            return true;
+        }
+        pos += 4 + field_size;
+    }
+    return true; // no ZIP64 extra field, the all ones values are real
+}
 
-                XML::Node bg("a:bgFillStyleLst");
-                {
-                    XML::Node solid("a:solidFill");
-                    {
-                        XML::Node scheme("a:schemeClr");
-                        scheme.attributes["val"] = "phClr";
-                        scheme.self_closing = true;
-                        solid.add_child(scheme);
-                    }
-                    bg.add_child(solid);
+inline uint16_t DOCXZipReader::get16(const char* p) {
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return u[0] | (u[1] << 8);
+}
+
+inline uint32_t DOCXZipReader::get32(const char* p) {
+    return get16(p) | (uint32_t(get16(p + 2)) << 16);
+}
+
+inline uint64_t DOCXZipReader::get64(const char* p) {
+    return get32(p) | (uint64_t(get32(p + 4)) << 32);
+}
+
+/////////////////////////////////
+// DOCX XML Reader definitions //
+/////////////////////////////////
+
+inline DOCXXmlReader::DOCXXmlReader(std::string_view set_xml) {
+    xml = set_xml;
+}
+
+inline bool DOCXXmlReader::next() {
+    tag_name = std::string_view();
+    attributes = std::string_view();
+    tag_cdata = std::string_view();
+    closing = false;
+    self_closing = false;
+
+    if (pos >= xml.size()) {
+        tag_text = std::string_view();
+        return false;
+    }
+    const char* lt = static_cast<const char*>(std::memchr(xml.data() + pos, '<', xml.size() - pos));
+    if (lt == nullptr) {
+        tag_text = xml.substr(pos);
+        pos = xml.size();
+        return false;
+    }
+    size_t start = lt - xml.data();
+    tag_text = xml.substr(pos, start - pos);
+
+    std::string_view rest = xml.substr(start);
+    size_t end = std::string_view::npos;
+    bool special = rest.size() > 1 && (rest[1] == '!' || rest[1] == '?');
+    if (!special) {
+        // Attribute values may contain >, so quotes have to be skipped
+        size_t i = 1;
+        if (i < rest.size() && rest[i] == '/') {
+            closing = true;
+            i++;
+        }
+        size_t name_start = i;
+        while (i < rest.size() && !is_space(rest[i]) && rest[i] != '>' && rest[i] != '/') {
+            i++;
+        }
+        tag_name = rest.substr(name_start, i - name_start);
+        size_t attributes_start = i;
+        while (i < rest.size() && rest[i] != '>') {
+            if (rest[i] == '"' || rest[i] == '\'') {
+                size_t quote = rest.find(rest[i], i + 1);
+                if (quote == std::string_view::npos) {
+                    i = rest.size();
+                    break;
                 }
-                fmt.add_child(bg);
+                i = quote;
+            }
+            i++;
+        }
+        if (i < rest.size()) {
+            end = i + 1;
+            self_closing = i > attributes_start && rest[i - 1] == '/';
+            attributes = rest.substr(attributes_start, i - attributes_start - (self_closing ? 1 : 0));
+        }
+    } else if (rest.substr(0, 4) == "<!--") {
+        end = rest.find("-->");
+        end = end == std::string_view::npos ? end : end + 3;
+    } else if (rest.substr(0, 9) == "<![CDATA[") {
+        end = rest.find("]]>");
+        if (end != std::string_view::npos) {
+            tag_cdata = rest.substr(9, end - 9);
+            end += 3;
+        }
+    } else if (rest.substr(0, 2) == "<?") {
+        end = rest.find("?>");
+        end = end == std::string_view::npos ? end : end + 2;
+    } else { // <!DOCTYPE and the like
+        end = rest.find('>');
+        end = end == std::string_view::npos ? end : end + 1;
+    }
+
+    if (end == std::string_view::npos) { // unterminated tag, the rest is ignored
+        tag_name = std::string_view();
+        pos = xml.size();
+        return false;
+    }
+    pos = start + end;
+    parsed = pos;
+    return true;
+}
+
+inline std::string_view DOCXXmlReader::name() const {
+    return tag_name;
+}
+
+inline bool DOCXXmlReader::is_start() const {
+    return !closing;
+}
+
+inline bool DOCXXmlReader::is_end() const {
+    return closing || self_closing;
+}
+
+inline std::string_view DOCXXmlReader::attribute(std::string_view attribute_name) const {
+    size_t i = 0;
+    while (i < attributes.size()) {
+        while (i < attributes.size() && is_space(attributes[i])) {
+            i++;
+        }
+        size_t name_start = i;
+        while (i < attributes.size() && attributes[i] != '=' && !is_space(attributes[i])) {
+            i++;
+        }
+        std::string_view cur_name = attributes.substr(name_start, i - name_start);
+        while (i < attributes.size() && (attributes[i] == '=' || is_space(attributes[i]))) {
+            i++;
+        }
+        if (i >= attributes.size() || (attributes[i] != '"' && attributes[i] != '\'')) {
+            return std::string_view();
+        }
+        size_t value_end = attributes.find(attributes[i], i + 1);
+        if (value_end == std::string_view::npos) {
+            return std::string_view();
+        }
+        if (cur_name == attribute_name) {
+            return attributes.substr(i + 1, value_end - i - 1);
+        }
+        i = value_end + 1;
+    }
+    return std::string_view();
+}
+
+inline std::string_view DOCXXmlReader::text() const {
+    return tag_text;
+}
+
+inline std::string_view DOCXXmlReader::cdata() const {
+    return tag_cdata;
+}
+
+inline size_t DOCXXmlReader::parsed_size() const {
+    return parsed;
+}
+
+// Unknown entities are kept as they are
+template <typename String>
+void DOCXXmlReader::append_unescaped(String& out, std::string_view str) {
+    size_t start = 0;
+    while (start < str.size()) {
+        const char* amp = static_cast<const char*>(std::memchr(str.data() + start, '&', str.size() - start));
+        if (amp == nullptr) {
+            break;
+        }
+        size_t i = amp - str.data();
+        size_t semicolon = str.find(';', i);
+        if (semicolon == std::string_view::npos) {
+            break;
+        }
+        out.append(str.data() + start, i - start);
+
+        std::string_view entity = str.substr(i + 1, semicolon - i - 1);
+        char utf8[4];
+        size_t utf8_size = 0;
+        if (entity == "amp") {
+            out += '&';
+        } else if (entity == "lt") {
+            out += '<';
+        } else if (entity == "gt") {
+            out += '>';
+        } else if (entity == "quot") {
+            out += '"';
+        } else if (entity == "apos") {
+            out += '\'';
+        } else if (entity.size() > 1 && entity[0] == '#') {
+            bool hex = entity[1] == 'x' || entity[1] == 'X';
+            uint32_t code_point = 0;
+            for (size_t j = hex ? 2 : 1; j < entity.size(); j++) {
+                char c = entity[j];
+                uint32_t digit = c >= '0' && c <= '9' ? c - '0'
+                    : hex && c >= 'a' && c <= 'f' ? c - 'a' + 10
+                    : hex && c >= 'A' && c <= 'F' ? c - 'A' + 10 : 0;
+                code_point = code_point * (hex ? 16 : 10) + digit;
+            }
+            utf8_size = encode_utf8(code_point, utf8);
+            out.append(utf8, utf8_size);
+        } else {
+            out.append(str.data() + i, semicolon + 1 - i);
+        }
+        start = semicolon + 1;
+    }
+    out.append(str.data() + start, str.size() - start);
+}
+
+inline bool DOCXXmlReader::is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+inline size_t DOCXXmlReader::encode_utf8(uint32_t code_point, char* out) {
+    if (code_point < 0x80) {
+        out[0] = static_cast<char>(code_point);
+        return 1;
+    }
+    if (code_point < 0x800) {
+        out[0] = static_cast<char>(0xC0 | (code_point >> 6));
+        out[1] = static_cast<char>(0x80 | (code_point & 0x3F));
+        return 2;
+    }
+    if (code_point < 0x10000) {
+        out[0] = static_cast<char>(0xE0 | (code_point >> 12));
+        out[1] = static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+        out[2] = static_cast<char>(0x80 | (code_point & 0x3F));
+        return 3;
+    }
+    if (code_point > 0x10FFFF) {
+        return 0;
+    }
+    out[0] = static_cast<char>(0xF0 | (code_point >> 18));
+    out[1] = static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+    out[2] = static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+    out[3] = static_cast<char>(0x80 | (code_point & 0x3F));
+    return 4;
+}
+
+/////////////////////////////////////
+// DOCX Text Extractor definitions //
+/////////////////////////////////////
+
+inline DOCXTextExtractor::DOCXTextExtractor(Sink set_sink) {
+    sink = set_sink;
+}
+
+inline bool DOCXTextExtractor::extract(const std::string& fname, Sink sink) {
+    DOCXZipReader zip;
+    if (!zip.open(fname)) {
+        return false;
+    }
+    return extract_package(zip, sink);
+}
+
+inline bool DOCXTextExtractor::extract_from_buffer(std::string_view buffer, Sink sink) {
+    DOCXZipReader zip;
+    if (!zip.open(buffer)) {
+        return false;
+    }
+    return extract_package(zip, sink);
+}
+
+inline bool DOCXTextExtractor::extract_package(const DOCXZipReader& zip, Sink sink) {
+    const DOCXZipReader::Entry* entry = zip.find("word/document.xml");
+    if (entry == nullptr) {
+        std::cerr << "No word/document.xml in the package" << newl;
+        return false;
+    }
+    DOCXTextExtractor extractor(sink);
+    bool ok = zip.read(*entry, [&extractor](const char* data, size_t len) {
+        extractor.feed(data, len);
+    });
+    extractor.finish();
+    return ok;
+}
+
+// Tags are parsed straight from data where possible, only what's left after the last complete
+// tag is copied to be parsed with the next piece
+inline void DOCXTextExtractor::feed(const char* data, size_t len) {
+    std::string_view xml(data, len);
+    if (!pending.empty()) {
+        pending.append(data, len);
+        xml = pending;
+    }
+
+    DOCXXmlReader reader(xml);
+    while (reader.next()) {
+        handle(reader);
+    }
+
+    if (pending.empty()) {
+        pending.assign(xml.substr(reader.parsed_size()));
+    } else {
+        pending.erase(0, reader.parsed_size());
+    }
+}
+
+inline void DOCXTextExtractor::finish() {
+    if (depth > 0) {
+        end_line();
+    }
+    pending.clear();
+    depth = run_depth = 0;
+    in_text = false;
+}
+
+inline void DOCXTextExtractor::handle(const DOCXXmlReader& reader) {
+    std::string_view name = reader.name();
+    if (in_text) {
+        DOCXXmlReader::append_unescaped(line, reader.text());
+        if (name.empty()) {
+            line.append(reader.cdata());
+        }
+    }
+
+    if (name == "w:p") {
+        if (reader.is_start()) {
+            depth++;
+            if (depth > 1 && !line.empty()) {
+                line += ' ';
             }
-            theme_elems.add_child(fmt);
         }
-        theme1.add_child(theme_elems);
+        if (reader.is_end() && depth > 0) {
+            depth--;
+            if (depth == 0) {
+                end_line();
+            } else {
+                line += ' ';
+            }
+        }
+    } else if (depth == 0) {
+        return;
+    } else if (name == "w:r") {
+        if (reader.is_start() && !reader.is_end()) {
+            run_depth++;
+        } else if (reader.is_end() && run_depth > 0) {
+            run_depth--;
+            in_text = false;
+        }
+    } else if (run_depth == 0) {
+        return; // w:tab is also a tab stop in the paragraph properties
+    } else if (name == "w:t") {
+        in_text = !reader.is_end();
+    } else if (name == "w:tab" && reader.is_start()) {
+        line += '\t';
+    } else if ((name == "w:br" || name == "w:cr") && reader.is_start()) {
+        line += ' ';
+    }
+}
+
+// Newlines in the text itself are replaced so that every paragraph stays on one line
+inline void DOCXTextExtractor::end_line() {
+    for (char c : { '\n', '\r' }) {
+        for (size_t i = line.find(c); i != std::string::npos; i = line.find(c, i + 1)) {
+            line[i] = ' ';
+        }
+    }
+    sink(line);
+    line.clear();
+    run_depth = 0;
+    in_text = false;
+}
+
+//////////////////////////////////
+// DOCX Allocations definitions //
+//////////////////////////////////
+
+inline DOCXAllocations::Scope::Scope(const char* set_phase) {
+    phase = set_phase;
+    if (!enabled()) {
+        return;
     }
-    return theme1.get_string();
+    active = true;
+    parent = thread_scope();
+    thread_scope() = this;
 }
 
+inline DOCXAllocations::Scope::~Scope() {
+    if (!active) {
+        return;
+    }
+
+    if (phase != nullptr) {
+        // Not counted, that would only be noise in the parent scopes
+        thread_scope() = nullptr;
+        Counts scope_counts = counts();
+        std::lock_guard<std::mutex> lock(totals_mutex);
+        Counts& total = phase_totals[phase];
+        total.calls++;
+        total.allocations += scope_counts.allocations;
+        total.bytes += scope_counts.bytes;
+        total.peak_bytes = std::max(total.peak_bytes, scope_counts.peak_bytes);
+    }
+    thread_scope() = parent;
+}
+
+inline DOCXAllocations::Counts DOCXAllocations::Scope::counts() const {
+    Counts scope_counts;
+    scope_counts.calls = 1;
+    scope_counts.allocations = allocations;
+    scope_counts.bytes = bytes;
+    scope_counts.peak_bytes = std::max<ptrdiff_t>(peak, 0);
+    return scope_counts;
+}
+
+inline DOCXAllocations::ThreadScope::ThreadScope(Scope* scope) {
+    previous = thread_scope();
+    thread_scope() = scope;
+}
+
+inline DOCXAllocations::ThreadScope::~ThreadScope() {
+    thread_scope() = previous;
+}
+
+inline void DOCXAllocations::set_enabled(bool set_enabled) {
+    counting = set_enabled;
+}
+
+inline bool DOCXAllocations::enabled() {
+    return counting;
+}
+
+inline DOCXAllocations::Scope* DOCXAllocations::current_scope() {
+    return thread_scope();
+}
+
+inline std::map<std::string, DOCXAllocations::Counts> DOCXAllocations::totals() {
+    std::lock_guard<std::mutex> lock(totals_mutex);
+    return phase_totals;
+}
+
+inline void DOCXAllocations::reset_totals() {
+    std::lock_guard<std::mutex> lock(totals_mutex);
+    phase_totals.clear();
+}
+
+// Must not allocate, it's called from operator new
+inline void DOCXAllocations::count_allocation(size_t size) {
+    for (Scope* scope = thread_scope(); scope != nullptr; scope = scope->parent) {
+        scope->allocations++;
+        scope->bytes += size;
+        ptrdiff_t current = scope->current += size;
+        ptrdiff_t peak = scope->peak;
+        while (current > peak && !scope->peak.compare_exchange_weak(peak, current)) {}
+    }
+}
+
+inline void DOCXAllocations::count_deallocation(size_t size) {
+    for (Scope* scope = thread_scope(); scope != nullptr; scope = scope->parent) {
+        scope->current -= size;
+    }
+}
+
+inline void* DOCXAllocations::zlib_alloc(void*, unsigned items, unsigned size) {
+    size_t total = size_t(items) * size;
+    char* block = static_cast<char*>(std::malloc(total + HEADER_SIZE));
+    if (block == nullptr) {
+        return Z_NULL;
+    }
+    *reinterpret_cast<size_t*>(block) = total;
+    count_allocation(total);
+    return block + HEADER_SIZE;
+}
+
+inline void DOCXAllocations::zlib_free(void*, void* ptr) {
+    char* block = static_cast<char*>(ptr) - HEADER_SIZE;
+    count_deallocation(*reinterpret_cast<size_t*>(block));
+    std::free(block);
+}
+
+inline DOCXAllocations::Scope*& DOCXAllocations::thread_scope() {
+    thread_local Scope* scope = nullptr;
+    return scope;
+}
+
+// Only one translation unit of a program may define DOCX_COUNT_ALLOCATIONS, it's where the
+// replacements of the global operator new and delete are defined
+#ifdef DOCX_COUNT_ALLOCATIONS
+
+static const bool docx_allocations_enabled = (DOCXAllocations::set_enabled(true), true);
+
+void* operator new(std::size_t size) {
+    char* block = static_cast<char*>(std::malloc(size + DOCXAllocations::HEADER_SIZE));
+    if (block == nullptr) {
+        throw std::bad_alloc();
+    }
+    *reinterpret_cast<size_t*>(block) = size;
+    DOCXAllocations::count_allocation(size);
+    return block + DOCXAllocations::HEADER_SIZE;
+}
+
+void operator delete(void* ptr) noexcept {
+    if (ptr == nullptr) {
+        return;
+    }
+    char* block = static_cast<char*>(ptr) - DOCXAllocations::HEADER_SIZE;
+    DOCXAllocations::count_deallocation(*reinterpret_cast<size_t*>(block));
+    std::free(block);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    ::operator delete(ptr);
+}
+
+void* operator new[](std::size_t size) {
+    return ::operator new(size);
+}
+
+void operator delete[](void* ptr) noexcept {
+    ::operator delete(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    ::operator delete(ptr);
+}
+
+// The nothrow versions have to go through the same header, their memory is freed by the ones above
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return ::operator new(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return ::operator new(size, std::nothrow);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    ::operator delete(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    ::operator delete(ptr);
+}
+
+// std::pmr::new_delete_resource() allocates through these. The size goes right in front of the
+// returned block, which is the alignment or HEADER_SIZE past the start of the allocation.
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    size_t offset = std::max(static_cast<size_t>(alignment), DOCXAllocations::HEADER_SIZE);
+    char* block = static_cast<char*>(std::aligned_alloc(offset, (size + offset * 2 - 1) / offset * offset));
+    if (block == nullptr) {
+        throw std::bad_alloc();
+    }
+    *reinterpret_cast<size_t*>(block + offset - sizeof(size_t)) = size;
+    DOCXAllocations::count_allocation(size);
+    return block + offset;
+}
+
+void operator delete(void* ptr, std::align_val_t alignment) noexcept {
+    if (ptr == nullptr) {
+        return;
+    }
+    size_t offset = std::max(static_cast<size_t>(alignment), DOCXAllocations::HEADER_SIZE);
+    char* block = static_cast<char*>(ptr) - offset;
+    DOCXAllocations::count_deallocation(*reinterpret_cast<size_t*>(block + offset - sizeof(size_t)));
+    std::free(block);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t alignment) noexcept {
+    ::operator delete(ptr, alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return ::operator new(size, alignment);
+}
+
+void operator delete[](void* ptr, std::align_val_t alignment) noexcept {
+    ::operator delete(ptr, alignment);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t alignment) noexcept {
+    ::operator delete(ptr, alignment);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    try {
+        return ::operator new(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return ::operator new(size, alignment, std::nothrow);
+}
+
+void operator delete(void* ptr, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    ::operator delete(ptr, alignment);
+}
+
+void operator delete[](void* ptr, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    ::operator delete(ptr, alignment);
+}
+
+#endif
+
 #endif
\ No newline at end of file
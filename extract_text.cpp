@@ -0,0 +1,47 @@
+/*
+This file is part of Simple Office Open XML Document (docx) Library.
+
+Simple Office Open XML Document (docx) Library is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of
+the License, or (at your option) any later version.
+
+Simple Office Open XML Document (docx) Library is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with Simple Office Open XML Document (docx) Library.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Prints the text of every paragraph of one or more .docx files, one paragraph per line, for
+// feeding search indexers and the like. word/document.xml is streamed, so files of any size can
+// be extracted without loading them.
+//
+// Usage: ./extract_text file.docx...
+
+#include "docx.hpp"
+
+#include <cstdio>
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " file.docx..." << newl;
+        return 1;
+    }
+
+    static char buffer[1 << 16];
+    std::setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+
+    int result = 0;
+    for (int i = 1; i < argc; i++) {
+        bool ok = DOCXTextExtractor::extract(argv[i], [](std::string_view paragraph) {
+            std::fwrite(paragraph.data(), 1, paragraph.size(), stdout);
+            std::fputc('\n', stdout);
+        });
+        if (!ok) {
+            result = 1;
+        }
+    }
+    std::fflush(stdout);
+    return result;
+}
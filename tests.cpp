@@ -0,0 +1,204 @@
+/*
+This file is part of Simple Office Open XML Document (docx) Library.
+
+Simple Office Open XML Document (docx) Library is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of
+the License, or (at your option) any later version.
+
+Simple Office Open XML Document (docx) Library is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with Simple Office Open XML Document (docx) Library.
+If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Regression tests. Prints every failed check and exits with 1 if there were any. Build with
+// ./build.sh tests, which builds them with AddressSanitizer so that memory errors fail too.
+
+#include "docx.hpp"
+
+#include <cstdio>
+
+static int failures = 0;
+
+static void check(bool condition, const char* what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << newl;
+        failures++;
+    }
+}
+
+static std::string save_to_string(DOCX& docx) {
+    std::string out;
+    docx.save([&out](const char* data, size_t len) {
+        out.append(data, len);
+    });
+    return out;
+}
+
+static DOCX::Paragraph make_paragraph(const std::string& text) {
+    DOCX::Paragraph p;
+    p.add_plain_text(text);
+    p.add_space();
+    p.add_bold_text("bold");
+    return p;
+}
+
+// Copies and moves share the arena, clearing one of them must not free the other's memory
+static void test_arena_copy_clear() {
+    DOCX original(DOCX::default_settings(), 1 << 12);
+    for (size_t i = 0; i < 200; i++) {
+        original.add_paragraph(make_paragraph("paragraph " + std::to_string(i)));
+    }
+
+    DOCX copy = original;
+    copy.clear();
+    copy.add_paragraph(make_paragraph("after clear"));
+    DOCX loaded;
+    check(loaded.load_from_buffer(save_to_string(original)), "arena copy: original saves and loads after the copy is cleared");
+    check(loaded.paragraph_count() == 200, "arena copy: original keeps its paragraphs");
+    check(loaded.load_from_buffer(save_to_string(copy)), "arena copy: cleared copy saves and loads");
+    check(loaded.paragraph_count() == 1, "arena copy: cleared copy only has the new paragraph");
+
+    DOCX moved = std::move(original);
+    original.clear();
+    original.add_paragraph(make_paragraph("moved from"));
+    check(loaded.load_from_buffer(save_to_string(moved)), "arena move: moved-to document saves after the moved-from one is cleared");
+    check(loaded.paragraph_count() == 200, "arena move: moved-to document keeps its paragraphs");
+    check(loaded.load_from_buffer(save_to_string(original)), "arena move: cleared moved-from document saves and loads");
+    check(loaded.paragraph_count() == 1, "arena move: moved-from document only has the new paragraph");
+}
+
+// A package saved by this library with word/document.xml replaced by xml
+static std::string package_with_document(const std::string& xml) {
+    DOCX docx;
+    std::string saved = save_to_string(docx);
+    DOCXZipReader reader;
+    reader.open(std::string_view(saved));
+
+    std::string package;
+    DOCXZip zip([&package](const char* data, size_t len) {
+        package.append(data, len);
+    });
+    for (const DOCXZipReader::Entry& entry : reader.get_entries()) {
+        if (entry.name == "word/document.xml") {
+            zip.add_file(entry.name, xml);
+        } else {
+            zip.add_raw_file(entry.name, entry.method, entry.crc, entry.size, { reader.compressed_data(entry) });
+        }
+    }
+    zip.finish();
+    return package;
+}
+
+// The old properties of tracked format changes are neither applied nor end the properties around them
+static void test_load_tracked_format_change() {
+    std::string xml =
+        "<w:document xmlns:w=\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\"><w:body><w:p>"
+        "<w:pPr><w:jc w:val=\"center\"/><w:pPrChange w:id=\"1\" w:author=\"a\"><w:pPr><w:jc w:val=\"right\"/></w:pPr></w:pPrChange>"
+        "<w:rPr><w:sz w:val=\"30\"/></w:rPr></w:pPr>"
+        "<w:r><w:rPr><w:i/><w:rPrChange w:id=\"2\" w:author=\"a\"><w:rPr><w:b/><w:sz w:val=\"40\"/></w:rPr></w:rPrChange>"
+        "<w:u w:val=\"single\"/></w:rPr><w:t>changed</w:t></w:r>"
+        "</w:p></w:body></w:document>";
+    DOCX docx;
+    check(docx.load_from_buffer(package_with_document(xml)), "tracked change: loads");
+    check(docx.paragraph_count() == 1, "tracked change: one paragraph");
+    if (docx.paragraph_count() != 1) {
+        return;
+    }
+
+    std::string out;
+    docx.get_paragraph(0).write(out, DOCX::default_settings());
+    check(out.find("<w:jc w:val=\"center\"/>") != std::string::npos, "tracked change: alignment from before the change is kept");
+    check(out.find("<w:i/>") != std::string::npos, "tracked change: property before w:rPrChange is applied");
+    check(out.find("<w:u w:val=\"single\"/>") != std::string::npos, "tracked change: property after w:rPrChange is applied");
+    check(out.find("<w:b/>") == std::string::npos, "tracked change: old bold is not applied");
+    check(out.find("<w:sz w:val=\"40\"/>") == std::string::npos, "tracked change: old size is not applied");
+    check(out.find("<w:sz w:val=\"30\"/>") != std::string::npos, "tracked change: paragraph size after w:pPrChange is read");
+}
+
+// Appended runs keep this document's default size and typefaces in a target with other defaults
+static void test_append_explicit_defaults() {
+    std::string fname = "test_append_target.docx";
+    DOCX::Settings target_settings = DOCX::default_settings();
+    target_settings.font_size = 20;
+    target_settings.latin_typeface = "Arial";
+    DOCX target(target_settings);
+    target.add_paragraph(make_paragraph("target"));
+    target.save(fname);
+
+    DOCX::Settings source_settings = DOCX::default_settings();
+    source_settings.compact_markup = true;
+    DOCX source(source_settings);
+    source.add_paragraph(make_paragraph("appended"));
+    check(source.append_to(fname), "append defaults: appends");
+
+    DOCXZipReader reader;
+    std::string xml;
+    check(reader.open(fname) && reader.find("word/document.xml") != nullptr && reader.read(*reader.find("word/document.xml"), xml),
+        "append defaults: document.xml reads back");
+    size_t appended = xml.find("appended");
+    size_t run_start = xml.rfind("<w:r>", appended);
+    check(appended != std::string::npos && run_start != std::string::npos, "append defaults: appended run is there");
+    if (appended != std::string::npos && run_start != std::string::npos) {
+        std::string_view run(xml.data() + run_start, appended - run_start);
+        std::string size = "<w:sz w:val=\"" + std::to_string(source_settings.font_size * 2) + "\"/>";
+        check(run.find(size) != std::string::npos, "append defaults: the source's default size is explicit");
+        check(run.find("w:ascii=\"" + source_settings.latin_typeface + "\"") != std::string::npos, "append defaults: the source's default typeface is explicit");
+    }
+    reader.close();
+    std::remove(fname.c_str());
+}
+
+// Saving through a symlink replaces the file it points to and keeps that file's permissions
+static void test_save_through_symlink() {
+    namespace fs = std::filesystem;
+    fs::path dir = fs::temp_directory_path() / ("docx_tests_" + std::to_string(getpid()));
+    fs::create_directories(dir / "real");
+    fs::path target = dir / "real" / "document.docx";
+    fs::path link = dir / "link.docx";
+
+    DOCX first;
+    first.add_paragraph(make_paragraph("first"));
+    first.save(target.string());
+    fs::permissions(target, fs::perms::owner_read | fs::perms::owner_write | fs::perms::group_read);
+    fs::create_symlink(fs::path("real") / "document.docx", link);
+
+    DOCX second;
+    second.add_paragraph(make_paragraph("second"));
+    second.add_paragraph(make_paragraph("third"));
+    second.save(link.string());
+
+    check(fs::is_symlink(fs::symlink_status(link)), "symlink: the link is still a link");
+    check((fs::status(target).permissions() & fs::perms::all) == (fs::perms::owner_read | fs::perms::owner_write | fs::perms::group_read),
+        "symlink: the target keeps its permissions");
+    DOCX loaded;
+    check(loaded.load(target.string()) && loaded.paragraph_count() == 2, "symlink: the target has the new contents");
+    size_t files = 0;
+    for (const fs::directory_entry& entry : fs::recursive_directory_iterator(dir)) {
+        files += entry.is_regular_file() && !entry.is_symlink();
+    }
+    check(files == 1, "symlink: no temp files are left");
+
+    first.save(target.string());
+    check((fs::status(target).permissions() & fs::perms::all) == (fs::perms::owner_read | fs::perms::owner_write | fs::perms::group_read),
+        "permissions: a file saved over keeps its permissions");
+
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+}
+
+int main() {
+    test_arena_copy_clear();
+    test_load_tracked_format_change();
+    test_append_explicit_defaults();
+    test_save_through_symlink();
+
+    if (failures > 0) {
+        std::cerr << failures << " checks failed" << newl;
+        return 1;
+    }
+    std::cout << "all tests passed" << newl;
+    return 0;
+}